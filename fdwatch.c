@@ -0,0 +1,293 @@
+/* fdwatch.c - fd watcher routines, either epoll() or select()
+*/
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "port.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#else /* HAVE_EPOLL */
+#include <sys/select.h>
+#endif /* HAVE_EPOLL */
+
+#include "fdwatch.h"
+
+
+/* All the state is per-thread, so each thread can run its own watcher. */
+
+#ifdef HAVE_EPOLL
+
+static __thread int epoll_fd = -1;
+static __thread struct epoll_event* epoll_events;
+static __thread int nepoll_events;
+static __thread int nreturned, next_ridx;
+
+
+int
+fdwatch_get_nfiles( int nfiles )
+    {
+    return nfiles;
+    }
+
+
+int
+fdwatch_init( int nfiles )
+    {
+    epoll_fd = epoll_create( nfiles > 0 ? nfiles : 1 );
+    if ( epoll_fd < 0 )
+	return -1;
+    (void) fcntl( epoll_fd, F_SETFD, FD_CLOEXEC );
+    /* One wakeup never needs to return more events than this; the rest
+    ** simply wait for the next call.
+    */
+    nepoll_events = nfiles < 4096 ? nfiles : 4096;
+    if ( nepoll_events < 1 )
+	nepoll_events = 1;
+    epoll_events = (struct epoll_event*) malloc(
+	sizeof(struct epoll_event) * nepoll_events );
+    if ( epoll_events == (struct epoll_event*) 0 )
+	return -1;
+    nreturned = next_ridx = 0;
+    return nfiles;
+    }
+
+
+const char*
+fdwatch_method( void )
+    {
+    return "epoll";
+    }
+
+
+int
+fdwatch_add_fd( int fd, int client_data, int rw )
+    {
+    struct epoll_event ev;
+
+    /* Always ask for both directions, edge-triggered.  The descriptor
+    ** then never needs to be touched again until it is closed.
+    */
+    (void) rw;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u64 = 0;
+    ev.data.fd = client_data;
+    if ( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+	return -1;
+    return 0;
+    }
+
+
+void
+fdwatch_mod_fd( int fd, int rw )
+    {
+    /* Nothing to do, both directions are always registered. */
+    (void) fd;
+    (void) rw;
+    }
+
+
+void
+fdwatch_del_fd( int fd )
+    {
+    /* Nothing to do either, close() removes the descriptor from the
+    ** epoll set.  Saves a syscall per connection.
+    */
+    (void) fd;
+    }
+
+
+int
+fdwatch( long timeout_msecs )
+    {
+    int r;
+
+    r = epoll_wait( epoll_fd, epoll_events, nepoll_events, (int) timeout_msecs );
+    if ( r < 0 )
+	{
+	if ( errno == EINTR )
+	    r = 0;
+	nreturned = next_ridx = 0;
+	return r;
+	}
+    nreturned = r;
+    next_ridx = 0;
+    return r;
+    }
+
+
+int
+fdwatch_get_next( int* eventsP )
+    {
+    struct epoll_event* ev;
+
+    if ( next_ridx >= nreturned )
+	return -1;
+    ev = &epoll_events[next_ridx++];
+    *eventsP = 0;
+    if ( ev->events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) )
+	*eventsP |= FDW_READ;
+    if ( ev->events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) )
+	*eventsP |= FDW_WRITE;
+    return ev->data.fd;
+    }
+
+#else /* HAVE_EPOLL */
+
+static __thread fd_set master_rfdset;
+static __thread fd_set master_wfdset;
+static __thread fd_set working_rfdset;
+static __thread fd_set working_wfdset;
+static __thread int* fd_data;
+static __thread int maxfd, next_fd;
+static __thread int nreturned;
+
+
+int
+fdwatch_get_nfiles( int nfiles )
+    {
+    /* select() can't handle descriptors past FD_SETSIZE. */
+    if ( nfiles > FD_SETSIZE )
+	nfiles = FD_SETSIZE;
+    return nfiles;
+    }
+
+
+int
+fdwatch_init( int nfiles )
+    {
+    int fd;
+
+    nfiles = fdwatch_get_nfiles( nfiles );
+    FD_ZERO( &master_rfdset );
+    FD_ZERO( &master_wfdset );
+    fd_data = (int*) malloc( sizeof(int) * FD_SETSIZE );
+    if ( fd_data == (int*) 0 )
+	return -1;
+    for ( fd = 0; fd < FD_SETSIZE; ++fd )
+	fd_data[fd] = -1;
+    maxfd = -1;
+    next_fd = 0;
+    nreturned = 0;
+    return nfiles;
+    }
+
+
+const char*
+fdwatch_method( void )
+    {
+    return "select";
+    }
+
+
+int
+fdwatch_add_fd( int fd, int client_data, int rw )
+    {
+    if ( fd < 0 || fd >= FD_SETSIZE )
+	{
+	errno = EMFILE;
+	return -1;
+	}
+    fd_data[fd] = client_data;
+    fdwatch_mod_fd( fd, rw );
+    if ( fd > maxfd )
+	maxfd = fd;
+    return 0;
+    }
+
+
+void
+fdwatch_mod_fd( int fd, int rw )
+    {
+    if ( rw & FDW_READ )
+	FD_SET( fd, &master_rfdset );
+    else
+	FD_CLR( fd, &master_rfdset );
+    if ( rw & FDW_WRITE )
+	FD_SET( fd, &master_wfdset );
+    else
+	FD_CLR( fd, &master_wfdset );
+    }
+
+
+void
+fdwatch_del_fd( int fd )
+    {
+    if ( fd < 0 || fd >= FD_SETSIZE )
+	return;
+    FD_CLR( fd, &master_rfdset );
+    FD_CLR( fd, &master_wfdset );
+    /* Also drop any pending result so a reused slot isn't serviced twice. */
+    FD_CLR( fd, &working_rfdset );
+    FD_CLR( fd, &working_wfdset );
+    fd_data[fd] = -1;
+    while ( maxfd >= 0 && fd_data[maxfd] == -1 )
+	--maxfd;
+    }
+
+
+int
+fdwatch( long timeout_msecs )
+    {
+    struct timeval timeout;
+    int r;
+
+    working_rfdset = master_rfdset;
+    working_wfdset = master_wfdset;
+    next_fd = 0;
+    if ( timeout_msecs == INFTIM )
+	r = select(
+	    maxfd + 1, &working_rfdset, &working_wfdset, (fd_set*) 0,
+	    (struct timeval*) 0 );
+    else
+	{
+	timeout.tv_sec = timeout_msecs / 1000L;
+	timeout.tv_usec = ( timeout_msecs % 1000L ) * 1000L;
+	r = select(
+	    maxfd + 1, &working_rfdset, &working_wfdset, (fd_set*) 0,
+	    &timeout );
+	}
+    if ( r < 0 )
+	{
+	if ( errno == EINTR )
+	    r = 0;
+	nreturned = 0;
+	return r;
+	}
+    nreturned = r;
+    return r;
+    }
+
+
+int
+fdwatch_get_next( int* eventsP )
+    {
+    int fd;
+
+    if ( nreturned <= 0 )
+	return -1;
+    for ( fd = next_fd; fd <= maxfd; ++fd )
+	{
+	*eventsP = 0;
+	if ( FD_ISSET( fd, &working_rfdset ) )
+	    *eventsP |= FDW_READ;
+	if ( FD_ISSET( fd, &working_wfdset ) )
+	    *eventsP |= FDW_WRITE;
+	if ( *eventsP != 0 && fd_data[fd] != -1 )
+	    {
+	    next_fd = fd + 1;
+	    return fd_data[fd];
+	    }
+	}
+    next_fd = fd;
+    return -1;
+    }
+
+#endif /* HAVE_EPOLL */
@@ -0,0 +1,58 @@
+/* fdwatch.h - header file for fdwatch package
+**
+** This package abstracts the use of epoll() and select().  Under epoll
+** each descriptor is registered once, edge-triggered, for both reading
+** and writing; the caller must therefore keep reading or writing until
+** it gets EAGAIN.  The select() fallback is level-triggered and honors
+** the read/write interest given to fdwatch_add_fd() / fdwatch_mod_fd().
+*/
+
+#ifndef _FDWATCH_H_
+#define _FDWATCH_H_
+
+#define FDW_READ 1
+#define FDW_WRITE 2
+
+#ifndef INFTIM
+#define INFTIM -1
+#endif /* INFTIM */
+
+/* Pass in the number of descriptors you would like to watch; returns
+** how many the mechanism can actually handle.
+*/
+extern int fdwatch_get_nfiles( int nfiles );
+
+/* Initialize the fdwatch package for the calling thread; each thread
+** that calls this gets its own, independent watcher.  Returns how many
+** descriptors it can handle, or -1 on errors.
+*/
+extern int fdwatch_init( int nfiles );
+
+/* Returns the name of the mechanism in use, for reporting. */
+extern const char* fdwatch_method( void );
+
+/* Add a descriptor to the watch list.  rw is FDW_READ and/or FDW_WRITE.
+** Returns 0 on success, -1 if the descriptor can't be watched.
+*/
+extern int fdwatch_add_fd( int fd, int client_data, int rw );
+
+/* Change the interest of a watched descriptor. */
+extern void fdwatch_mod_fd( int fd, int rw );
+
+/* Remove a descriptor from the watch list.  Call this before close(). */
+extern void fdwatch_del_fd( int fd );
+
+/* Do the watch.  Return value is the number of descriptors that are ready,
+** or 0 if the timeout expired, or -1 on errors.  A timeout of INFTIM means
+** wait indefinitely.
+*/
+extern int fdwatch( long timeout_msecs );
+
+/* Iterate over the descriptors that fdwatch() reported ready.  Returns the
+** client data given to fdwatch_add_fd() and stores the FDW_READ / FDW_WRITE
+** bits that fired in *eventsP; returns -1 when there are no more.  Errors
+** and hangups are reported as both bits, so the handler finds out.
+*/
+extern int fdwatch_get_next( int* eventsP );
+
+#endif /* _FDWATCH_H_ */
@@ -0,0 +1,325 @@
+/* hdrbench.c - time the response header scanner
+**
+** Runs a header state machine shaped like http_load's over some
+** response header blocks, once a byte at a time and once with the
+** hdrscan fast paths, and reports bytes per cycle for each.  It checks
+** first that both get the same answers, with the headers cut into two
+** reads at every possible place.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "hdrscan.h"
+
+#define ST_TEXT 0
+#define ST_BOL 1	/* after a line end */
+#define ST_CR 2
+#define ST_BLANK_CR 3
+#define ST_NAME 4
+#define ST_VALUE 5
+#define ST_NUM 6
+#define ST_DONE 7
+
+static const char* names[] = { "content-length:", "connection:", "transfer-encoding:" };
+
+typedef struct {
+    int state;
+    int header;	/* 0-2, while in ST_NAME, ST_VALUE or ST_NUM */
+    int pos;
+    long content_length;
+    int keep_alive, chunked;
+    } parser;
+
+
+static void
+line_end( parser* ps, int c )
+    {
+    ps->state = c == '\r' ? ST_CR : ST_BOL;
+    }
+
+
+/* Feed it bytes; returns how many it used, all of them unless the
+** headers ended.
+*/
+static int
+parse( parser* ps, const char* buf, int len, int fast )
+    {
+    int i, c, name_len, h;
+
+    for ( i = 0; i < len && ps->state != ST_DONE; ++i )
+	{
+	if ( fast )
+	    {
+	    if ( ps->state == ST_TEXT )
+		i = hdr_find_eol( &buf[i], &buf[len - 1] ) - buf;
+	    else if ( ( ps->state == ST_BOL || ps->state == ST_CR ) &&
+		      buf[i] != '\r' && buf[i] != '\n' )
+		{
+		h = hdr_name( &buf[i], &buf[len], &name_len );
+		if ( h == HDR_OTHER )
+		    {
+		    ps->state = ST_TEXT;
+		    continue;
+		    }
+		if ( h != HDR_SHORT )
+		    {
+		    ps->header = h - HDR_CONTENT_LENGTH;
+		    ps->state = ST_VALUE;
+		    i += name_len - 1;
+		    continue;
+		    }
+		}
+	    }
+
+	c = (unsigned char) buf[i];
+	switch ( ps->state )
+	    {
+	    case ST_TEXT:
+	    if ( c == '\r' || c == '\n' )
+		line_end( ps, c );
+	    break;
+
+	    case ST_CR:
+	    if ( c == '\n' )
+		{
+		ps->state = ST_BOL;
+		break;
+		}
+	    /* fall through */
+	    case ST_BOL:
+	    if ( c == '\r' )
+		ps->state = ps->state == ST_BOL ? ST_BLANK_CR : ST_DONE;
+	    else if ( c == '\n' )
+		ps->state = ST_DONE;
+	    else if ( c == 'C' || c == 'c' || c == 'T' || c == 't' )
+		{
+		ps->state = ST_NAME;
+		ps->header = c == 'T' || c == 't' ? 2 : 0;
+		ps->pos = 1;
+		}
+	    else
+		ps->state = ST_TEXT;
+	    break;
+
+	    case ST_BLANK_CR:
+	    ps->state = ST_DONE;
+	    break;
+
+	    case ST_NAME:
+	    if ( c == '\r' || c == '\n' )
+		{
+		line_end( ps, c );
+		break;
+		}
+	    if ( c >= 'A' && c <= 'Z' )
+		c += 'a' - 'A';
+	    /* Content-length and connection part at the fourth letter. */
+	    if ( ps->header == 0 && ps->pos == 3 && c == 'n' )
+		ps->header = 1;
+	    if ( c != names[ps->header][ps->pos] )
+		{
+		ps->state = ST_TEXT;
+		break;
+		}
+	    if ( names[ps->header][++ps->pos] == '\0' )
+		ps->state = ST_VALUE;
+	    break;
+
+	    case ST_VALUE:
+	    if ( c == ' ' || c == '\t' )
+		break;
+	    if ( c == '\r' || c == '\n' )
+		{
+		line_end( ps, c );
+		break;
+		}
+	    ps->state = ST_TEXT;
+	    if ( ps->header == 0 && c >= '0' && c <= '9' )
+		{
+		ps->content_length = c - '0';
+		ps->state = ST_NUM;
+		}
+	    else if ( ps->header == 1 )
+		ps->keep_alive = c == 'k' || c == 'K';
+	    else if ( ps->header == 2 )
+		ps->chunked = c == 'c' || c == 'C';
+	    break;
+
+	    case ST_NUM:
+	    if ( c >= '0' && c <= '9' )
+		ps->content_length = ps->content_length * 10 + c - '0';
+	    else if ( c == '\r' || c == '\n' )
+		line_end( ps, c );
+	    else
+		ps->state = ST_TEXT;
+	    break;
+	    }
+	}
+    return i;
+    }
+
+
+static void
+start( parser* ps )
+    {
+    (void) memset( (void*) ps, 0, sizeof(*ps) );
+    ps->state = ST_TEXT;	/* the status line */
+    ps->content_length = -1;
+    }
+
+
+static unsigned long long
+cycles( void )
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    (void) clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+
+static const char small[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 5\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const char typical[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 12 Oct 2026 09:14:07 GMT\r\n"
+    "Server: Apache/2.4.62 (Unix) OpenSSL/3.0.15\r\n"
+    "Content-Type: text/html; charset=UTF-8\r\n"
+    "Cache-Control: private, max-age=0, must-revalidate\r\n"
+    "Expires: Mon, 12 Oct 2026 09:14:07 GMT\r\n"
+    "Last-Modified: Sun, 11 Oct 2026 22:40:51 GMT\r\n"
+    "ETag: \"5f2a-61c3b0e4d2a80-gzip\"\r\n"
+    "Vary: Accept-Encoding, Cookie, User-Agent\r\n"
+    "Set-Cookie: session=4f0c2a9be71d48c3a6b5e2f1d0c9b8a7; Path=/; HttpOnly; Secure; SameSite=Lax\r\n"
+    "X-Frame-Options: SAMEORIGIN\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Length: 24362\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static char big[8192];
+
+
+static void
+make_big( void )
+    {
+    int i, n;
+
+    /* A CDN-ish response, with a pile of cookies and a long policy. */
+    n = snprintf( big, sizeof(big), "%s", "HTTP/1.1 200 OK\r\n" );
+    for ( i = 0; i < 12; ++i )
+	n += snprintf( &big[n], sizeof(big) - n,
+	    "Set-Cookie: tracking_%d=%032d%032d; Domain=.example.com; Path=/; Expires=Tue, 12 Oct 2027 09:14:07 GMT; Secure\r\n",
+	    i, i * 7919, i * 104729 );
+    n += snprintf( &big[n], sizeof(big) - n,
+	"Content-Security-Policy: default-src 'self'; script-src 'self' 'unsafe-inline' https://cdn.example.com https://www.googletagmanager.com https://www.google-analytics.com; img-src 'self' data: https:; style-src 'self' 'unsafe-inline' https://fonts.googleapis.com; font-src 'self' https://fonts.gstatic.com; connect-src 'self' https://api.example.com\r\n"
+	"X-Cache: Hit from cloudfront\r\n"
+	"Via: 1.1 3c8f2d0e4a1b9c7d6e5f4a3b2c1d0e9f.cloudfront.net (CloudFront)\r\n"
+	"X-Amz-Cf-Pop: FRA56-P5\r\n"
+	"X-Amz-Cf-Id: q3Jk1x0aVb8Y7z6W5v4U3t2S1r0Q9p8O7n6M5l4K3j2I1h0G==\r\n"
+	"Transfer-Encoding: chunked\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n" );
+    }
+
+
+static int
+check( const char* what, const char* text )
+    {
+    parser a, b;
+    int len, cut, ua, ub;
+
+    len = strlen( text );
+    for ( cut = 0; cut <= len; ++cut )
+	{
+	start( &a );
+	start( &b );
+	ua = parse( &a, text, len, 0 );
+	ub = parse( &b, text, cut, 1 );
+	if ( b.state != ST_DONE )
+	    ub = cut + parse( &b, &text[cut], len - cut, 1 );
+	if ( ua != ub || a.state != b.state ||
+	     a.content_length != b.content_length ||
+	     a.keep_alive != b.keep_alive || a.chunked != b.chunked )
+	    {
+	    (void) fprintf( stderr, "%s: mismatch cut at %d\n", what, cut );
+	    return 0;
+	    }
+	}
+    return 1;
+    }
+
+
+static void
+bench( const char* what, const char* text )
+    {
+    parser ps;
+    int len, fast, i, iters;
+    unsigned long long t, best;
+
+    len = strlen( text );
+    iters = 2000000 / len + 1;
+    (void) printf( "%-8s %5d bytes", what, len );
+    for ( fast = 0; fast <= 1; ++fast )
+	{
+	best = ~0ULL;
+	/* Best of a few, to stay clear of interrupts and the like. */
+	for ( t = 0; t < 5; ++t )
+	    {
+	    unsigned long long t0 = cycles();
+	    for ( i = 0; i < iters; ++i )
+		{
+		start( &ps );
+		(void) parse( &ps, text, len, fast );
+		__asm__ __volatile__( "" : : "g" (&ps) : "memory" );
+		}
+	    t0 = cycles() - t0;
+	    if ( t0 < best )
+		best = t0;
+	    }
+	(void) printf( "   %s %6.3f bytes/cycle", fast ? "scanner" : "bytewise",
+	    (double) len * iters / best );
+	}
+    (void) printf( "\n" );
+    }
+
+
+int
+main( int argc, char** argv )
+    {
+    make_big();
+    if ( ! check( "small", small ) || ! check( "typical", typical ) ||
+	 ! check( "big", big ) )
+	exit( 1 );
+#if defined(__AVX2__)
+    (void) printf( "scanner: AVX2" );
+#elif defined(__SSE2__)
+    (void) printf( "scanner: SSE2" );
+#else
+    (void) printf( "scanner: no vectors" );
+#endif
+#if !defined(__x86_64__) && !defined(__i386__)
+    (void) printf( ", cycles are nanoseconds here" );
+#endif
+    (void) printf( "\n" );
+    bench( "small", small );
+    bench( "typical", typical );
+    bench( "big", big );
+    exit( 0 );
+    }
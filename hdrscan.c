@@ -0,0 +1,176 @@
+/* hdrscan.c - response header scanning routines
+*/
+
+#include "hdrscan.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Names get compared a whole vector at a time when there are this many
+** bytes left, which is more than the longest one.
+*/
+#define NAME_SPAN 32
+
+static const struct {
+    int type;
+    int len;
+    char text[NAME_SPAN];	/* lower case, padded with zeros */
+    } names[] = {
+    { HDR_CONTENT_LENGTH, 15, "content-length:" },
+    { HDR_CONNECTION, 11, "connection:" },
+    { HDR_TRANSFER_ENCODING, 18, "transfer-encoding:" },
+    };
+
+
+const char*
+hdr_find_eol( const char* p, const char* end )
+    {
+#ifdef __AVX2__
+    const __m256i cr32 = _mm256_set1_epi8( '\r' );
+    const __m256i lf32 = _mm256_set1_epi8( '\n' );
+    __m256i v32;
+    unsigned int m32;
+#endif
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8( '\r' );
+    const __m128i lf = _mm_set1_epi8( '\n' );
+    __m128i v;
+    unsigned int m;
+#endif
+
+#ifdef __AVX2__
+    for ( ; end - p >= 32; p += 32 )
+	{
+	v32 = _mm256_loadu_si256( (const __m256i*) p );
+	m32 = (unsigned int) _mm256_movemask_epi8( _mm256_or_si256(
+	    _mm256_cmpeq_epi8( v32, cr32 ), _mm256_cmpeq_epi8( v32, lf32 ) ) );
+	if ( m32 != 0 )
+	    return p + __builtin_ctz( m32 );
+	}
+#endif
+#ifdef __SSE2__
+    for ( ; end - p >= 16; p += 16 )
+	{
+	v = _mm_loadu_si128( (const __m128i*) p );
+	m = (unsigned int) _mm_movemask_epi8( _mm_or_si128(
+	    _mm_cmpeq_epi8( v, cr ), _mm_cmpeq_epi8( v, lf ) ) );
+	if ( m != 0 )
+	    return p + __builtin_ctz( m );
+	}
+#endif
+    /* The tail, or all of it without vectors. */
+    while ( p < end && *p != '\r' && *p != '\n' )
+	++p;
+    return p;
+    }
+
+
+#ifdef __SSE2__
+/* Compare NAME_SPAN bytes at p, folded to lower case, against a name.
+** Only ASCII capitals get folded, so no other byte can pass for a letter.
+*/
+static int
+match_vector( const char* p, int n )
+    {
+#ifdef __AVX2__
+    __m256i v, upper;
+    unsigned int want, eq;
+
+    v = _mm256_loadu_si256( (const __m256i*) p );
+    upper = _mm256_and_si256(
+	_mm256_cmpgt_epi8( v, _mm256_set1_epi8( 'A' - 1 ) ),
+	_mm256_cmpgt_epi8( _mm256_set1_epi8( 'Z' + 1 ), v ) );
+    v = _mm256_or_si256( v, _mm256_and_si256( upper, _mm256_set1_epi8( 0x20 ) ) );
+    eq = (unsigned int) _mm256_movemask_epi8( _mm256_cmpeq_epi8(
+	v, _mm256_loadu_si256( (const __m256i*) names[n].text ) ) );
+    want = ( 1U << names[n].len ) - 1;
+    return ( eq & want ) == want;
+#else /* __AVX2__ */
+    __m128i v, upper;
+    unsigned int want, eq;
+    int i, left;
+
+    for ( i = 0; i < names[n].len; i += 16 )
+	{
+	v = _mm_loadu_si128( (const __m128i*) &p[i] );
+	upper = _mm_and_si128(
+	    _mm_cmpgt_epi8( v, _mm_set1_epi8( 'A' - 1 ) ),
+	    _mm_cmpgt_epi8( _mm_set1_epi8( 'Z' + 1 ), v ) );
+	v = _mm_or_si128( v, _mm_and_si128( upper, _mm_set1_epi8( 0x20 ) ) );
+	eq = (unsigned int) _mm_movemask_epi8( _mm_cmpeq_epi8(
+	    v, _mm_loadu_si128( (const __m128i*) &names[n].text[i] ) ) );
+	left = names[n].len - i;
+	want = left >= 16 ? 0xffff : ( 1U << left ) - 1;
+	if ( ( eq & want ) != want )
+	    return 0;
+	}
+    return 1;
+#endif /* __AVX2__ */
+    }
+#endif /* __SSE2__ */
+
+
+/* The same a byte at a time, stopping at end: 1 for a match, 0 for
+** not, -1 if it matched as far as it went.
+*/
+static int
+match_scalar( const char* p, const char* end, int n )
+    {
+    int i, c;
+
+    for ( i = 0; i < names[n].len; ++i )
+	{
+	if ( p + i >= end )
+	    return -1;
+	c = (unsigned char) p[i];
+	if ( c >= 'A' && c <= 'Z' )
+	    c += 'a' - 'A';
+	if ( c != names[n].text[i] )
+	    return 0;
+	}
+    return 1;
+    }
+
+
+int
+hdr_name( const char* p, const char* end, int* lenP )
+    {
+    int first, last, n, r, partial;
+
+    if ( p >= end )
+	return HDR_SHORT;
+    /* The first letter narrows it down. */
+    switch ( *p )
+	{
+	case 'C': case 'c':
+	first = 0;
+	last = 1;
+	break;
+	case 'T': case 't':
+	first = last = 2;
+	break;
+	default:
+	return HDR_OTHER;
+	}
+    partial = 0;
+    for ( n = first; n <= last; ++n )
+	{
+#ifdef __SSE2__
+	if ( end - p >= NAME_SPAN )
+	    r = match_vector( p, n );
+	else
+#endif
+	r = match_scalar( p, end, n );
+	if ( r == 1 )
+	    {
+	    *lenP = names[n].len;
+	    return names[n].type;
+	    }
+	if ( r == -1 )
+	    partial = 1;
+	}
+    return partial ? HDR_SHORT : HDR_OTHER;
+    }
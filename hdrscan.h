@@ -0,0 +1,32 @@
+/* hdrscan.h - header file for response header scanning package
+**
+** The header parser walks a byte at a time, which is what it takes to
+** pick its way through a status line or a partial header name at the
+** end of a read.  Most header bytes are in lines it doesn't care about,
+** though, and the names it does care about are usually all there in
+** one piece.  These routines cover those cases 16 or 32 bytes at a
+** time with SSE2 or AVX2, whichever the compiler was told it can use,
+** or a byte at a time on anything else.  They never read past end.
+*/
+
+#ifndef _HDRSCAN_H_
+#define _HDRSCAN_H_
+
+/* Return the first CR or LF in [p, end), or end if there isn't one. */
+extern const char* hdr_find_eol( const char* p, const char* end );
+
+/* The headers worth telling apart. */
+#define HDR_OTHER 0
+#define HDR_SHORT 1	/* might be one of the others, ran out of bytes */
+#define HDR_CONTENT_LENGTH 2
+#define HDR_CONNECTION 3
+#define HDR_TRANSFER_ENCODING 4
+
+/* Say which header name, with its colon, starts a line at p, matching
+** case-insensitively, and store its length including the colon in
+** *lenP.  HDR_SHORT means the bytes up to end match the start of one,
+** so the caller has to look at it some other way.
+*/
+extern int hdr_name( const char* p, const char* end, int* lenP );
+
+#endif /* _HDRSCAN_H_ */
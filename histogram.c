@@ -0,0 +1,149 @@
+/* histogram.c - latency histogram routines
+*/
+
+#include "histogram.h"
+
+
+/* The bucket math works for any number of sub-bucket bits, so both
+** sizes of histogram share it.
+*/
+static int
+bucket_of( long long value, int sub_bits, int buckets )
+    {
+    int shift;
+
+    if ( value < ( 1 << sub_bits ) )
+	return (int) value;
+    if ( value >> HIST_MAX_BITS )
+	return buckets - 1;
+    /* Keep the top sub_bits bits of the value, the first of which is
+    ** always set.
+    */
+    shift = 64 - __builtin_clzll( (unsigned long long) value ) - sub_bits;
+    return ( 1 << sub_bits ) + ( shift - 1 ) * ( 1 << ( sub_bits - 1 ) ) +
+	(int) ( value >> shift ) - ( 1 << ( sub_bits - 1 ) );
+    }
+
+
+static long long
+highest_in_bucket( int b, int sub_bits )
+    {
+    int shift;
+    long long sub;
+
+    if ( b < ( 1 << sub_bits ) )
+	return b;
+    shift = ( b - ( 1 << sub_bits ) ) / ( 1 << ( sub_bits - 1 ) ) + 1;
+    sub = ( b - ( 1 << sub_bits ) ) % ( 1 << ( sub_bits - 1 ) ) +
+	( 1 << ( sub_bits - 1 ) );
+    return ( ( sub + 1 ) << shift ) - 1;
+    }
+
+
+static long long
+percentile( unsigned int* bucket, int buckets, int sub_bits, long long count,
+    long long max, double pct )
+    {
+    long long rank, seen;
+    int b;
+
+    if ( count == 0 )
+	return 0;
+    rank = (long long) ( pct / 100.0 * count + 0.999999 );
+    if ( rank < 1 )
+	rank = 1;
+    seen = 0;
+    for ( b = 0; b < buckets; ++b )
+	{
+	seen += bucket[b];
+	if ( seen >= rank )
+	    break;
+	}
+    /* The bucket's top end, but never past what was actually seen. */
+    if ( b >= buckets || highest_in_bucket( b, sub_bits ) > max )
+	return max;
+    return highest_in_bucket( b, sub_bits );
+    }
+
+
+void
+hist_record( Histogram* h, long long value )
+    {
+    if ( value < 0 )
+	value = 0;
+    ++h->buckets[bucket_of( value, HIST_SUB_BITS, HIST_BUCKETS )];
+    if ( h->count == 0 || value < h->min )
+	h->min = value;
+    if ( value > h->max )
+	h->max = value;
+    ++h->count;
+    h->total += value;
+    }
+
+
+void
+hist_small_record( SmallHistogram* h, long long value )
+    {
+    if ( value < 0 )
+	value = 0;
+    ++h->buckets[bucket_of( value, HIST_SMALL_SUB_BITS, HIST_SMALL_BUCKETS )];
+    if ( h->count == 0 || value < h->min )
+	h->min = value;
+    if ( value > h->max )
+	h->max = value;
+    ++h->count;
+    h->total += value;
+    }
+
+
+void
+hist_merge( Histogram* into, Histogram* from )
+    {
+    int b;
+
+    if ( from->count == 0 )
+	return;
+    for ( b = 0; b < HIST_BUCKETS; ++b )
+	into->buckets[b] += from->buckets[b];
+    if ( into->count == 0 || from->min < into->min )
+	into->min = from->min;
+    if ( from->max > into->max )
+	into->max = from->max;
+    into->count += from->count;
+    into->total += from->total;
+    }
+
+
+void
+hist_small_merge( SmallHistogram* into, SmallHistogram* from )
+    {
+    int b;
+
+    if ( from->count == 0 )
+	return;
+    for ( b = 0; b < HIST_SMALL_BUCKETS; ++b )
+	into->buckets[b] += from->buckets[b];
+    if ( into->count == 0 || from->min < into->min )
+	into->min = from->min;
+    if ( from->max > into->max )
+	into->max = from->max;
+    into->count += from->count;
+    into->total += from->total;
+    }
+
+
+long long
+hist_percentile( Histogram* h, double pct )
+    {
+    return percentile(
+	h->buckets, HIST_BUCKETS, HIST_SUB_BITS, h->count, h->max, pct );
+    }
+
+
+long long
+hist_small_percentile( SmallHistogram* h, double pct )
+    {
+    return percentile(
+	h->buckets, HIST_SMALL_BUCKETS, HIST_SMALL_SUB_BITS, h->count, h->max,
+	pct );
+    }
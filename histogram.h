@@ -0,0 +1,57 @@
+/* histogram.h - header file for latency histogram package
+**
+** Values go into log-linear buckets: below HIST_SUB_BUCKETS each value
+** gets its own bucket, above that every power of two is split into
+** HIST_SUB_BUCKETS / 2 equal buckets.  That keeps the error on any
+** percentile under 2 / HIST_SUB_BUCKETS, about 3%, in a fixed amount of
+** memory.  Recording is a few shifts and an increment, and never
+** allocates.  An all-zero histogram is a valid empty one.
+*/
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#define HIST_SUB_BITS 6
+#define HIST_SUB_BUCKETS ( 1 << HIST_SUB_BITS )
+/* Values up to 2^HIST_MAX_BITS are bucketed; bigger ones land in the
+** last bucket, though max still records them exactly.
+*/
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ( HIST_SUB_BUCKETS + ( HIST_MAX_BITS - HIST_SUB_BITS ) * ( HIST_SUB_BUCKETS / 2 ) )
+
+typedef struct {
+    long long count;
+    long long total;
+    long long min, max;
+    unsigned int buckets[HIST_BUCKETS];
+    } Histogram;
+
+/* The same with far fewer buckets, for keeping lots of them: a quarter
+** of the memory, and percentiles to within about 13%.
+*/
+#define HIST_SMALL_SUB_BITS 4
+#define HIST_SMALL_SUB_BUCKETS ( 1 << HIST_SMALL_SUB_BITS )
+#define HIST_SMALL_BUCKETS ( HIST_SMALL_SUB_BUCKETS + ( HIST_MAX_BITS - HIST_SMALL_SUB_BITS ) * ( HIST_SMALL_SUB_BUCKETS / 2 ) )
+
+typedef struct {
+    long long count;
+    long long total;
+    long long min, max;
+    unsigned int buckets[HIST_SMALL_BUCKETS];
+    } SmallHistogram;
+
+/* Add a value. */
+extern void hist_record( Histogram* h, long long value );
+extern void hist_small_record( SmallHistogram* h, long long value );
+
+/* Add all the values in one histogram into another. */
+extern void hist_merge( Histogram* into, Histogram* from );
+extern void hist_small_merge( SmallHistogram* into, SmallHistogram* from );
+
+/* Return the value that pct percent of the values are at or below, to
+** within the bucket precision.  Returns 0 for an empty histogram.
+*/
+extern long long hist_percentile( Histogram* h, double pct );
+extern long long hist_small_percentile( SmallHistogram* h, double pct );
+
+#endif /* _HISTOGRAM_H_ */
@@ -25,31 +25,48 @@
  ** SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* for pthread_setaffinity_np() */
+#endif
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
 #include <signal.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
 
 #ifdef USE_SSL
 #include <openssl/ssl.h>
-#include <openssl/rand.h>
 #include <openssl/err.h>
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+#error "https needs OpenSSL 1.1.1 or later"
+#endif
 #endif
 
 #include "version.h"
 #include "port.h"
 #include "timers.h"
+#include "fdwatch.h"
+#include "histogram.h"
+#include "hdrscan.h"
 
 #if defined(AF_INET6) && defined(IN6_IS_ADDR_V4MAPPED)
 #define USE_IPV6
@@ -70,29 +87,162 @@
 /* How many file descriptors to not use. */
 #define RESERVED_FDS 3
 
+/* How long a worker may sleep before noticing another one told it to stop. */
+#define STOP_CHECK_MSECS 100
+
+/* Most requests one connection may have outstanding with -pipeline; a
+** full pipeline's worth of requests goes out in one write.
+*/
+#define MAX_PIPELINE 64
+
+/* Size of a CPU cache line, for laying out the connection table. */
+#define CACHE_LINE 64
+
+/* A piece of a templated request line. */
+#define SEG_TEXT 0
+#define SEG_SEQ 1
+#define SEG_RAND 2
+typedef struct
+{
+	int type;
+	int off, len;	/* SEG_TEXT: the bytes in the URL's line */
+	unsigned long long low, range;	/* SEG_RAND */
+} segment;
+
+/* One address a hostname resolved to.  The port is filled in for each
+** connection.
+*/
 typedef struct
 {
-	char* url_str;
-	int weight;
-	int protocol;
-	char* hostname;
-	unsigned short port;
 #ifdef USE_IPV6
 	struct sockaddr_in6 sa;
 #else /* USE_IPV6 */
 	struct sockaddr_in sa;
 #endif /* USE_IPV6 */
 	int sa_len, sock_family, sock_type, sock_protocol;
-	char* filename;
-	int got_bytes;
-	long bytes;
-	int got_checksum;
-	long checksum;
+} address;
+
+/* Every address a hostname resolved to, looked up once for all the
+** hosts with that name.  With -resolve the list gets swapped for a new
+** one now and then, so connections read it through one pointer.
+*/
+typedef struct
+{
+	address* addrs;
+	int num_addrs;
+} address_list;
+typedef struct
+{
+	char* hostname;
+	address_list* list;
+} address_set;
+static address_set* address_sets;
+static int num_address_sets, max_address_sets;
+static int* address_hash;
+static unsigned int address_hash_size;
+
+/* Most threads looking up addresses at once at startup. */
+#define RESOLVERS 16
+static int next_to_resolve;
+static int resolve_secs;	/* with -resolve, how often to look again */
+
+/* How connections to a host choose among its addresses. */
+#define ROTATE_NONE 0	/* always the first */
+#define ROTATE_RR 1
+#define ROTATE_RANDOM 2
+static int rotate;
+static __thread unsigned int* address_turn;	/* per set, with ROTATE_RR */
+
+/* A host, however many URLs name it.  Through a proxy they all
+** connect to the proxy.
+*/
+typedef struct
+{
+	char* hostname;
+	unsigned short port;
+	int protocol;
+	int addresses;	/* index into address_sets */
+	/* The host whose connections it shares: itself, or through a proxy the
+	** first host with the same protocol.
+	*/
+	int pool;
+} host;
+static host* hosts;
+static int num_hosts, max_hosts;
+static int* host_hash;
+static unsigned int host_hash_size;
+
+/* The rest of a request after its request line, formatted once for
+** every URL with the same host, header set and body.  It ends
+** "Connection: close" and a blank line; the first open_len bytes plus
+** a CRLF make the request without it.
+*/
+typedef struct
+{
+	int key[4];	/* host, header set, body, empty body */
+	char* text;
+	int len, open_len;
+} tail;
+static tail* tails;
+static int num_tails, max_tails;
+static int* tail_hash;
+static unsigned int tail_hash_size;
+
+/* Small strings that last the whole run come out of big blocks. */
+#define ARENA_BLOCK (1024 * 1024)
+
+typedef struct
+{
+	char* url_str;	/* points into the mapped url_file */
+	int weight;
+	int host;	/* index into hosts */
+	char* method;
+	int body;	/* index into bodies, or -1 */
+	int headers;	/* index into header_sets, or -1 */
+	int tail;	/* index into tails */
+	/* The request line, formatted once.  A URL with {...} in it gets it
+	** rendered afresh for each request from segs instead.
+	*/
+	char* line;
+	int line_len;
+	segment* segs;
+	int num_segs;
 } url;
 typedef unsigned long turn_t;
-static url* urls;
+static url* url_table;	/* the url_file's, shared by all the workers */
+static __thread url* urls;	/* url_table, or replaying, this worker's own */
 static int num_urls, max_urls;
-static turn_t* urls_turn;
+/* Alias table for picking URLs by weight: column i is itself with
+** odds urls_odds[i] in wtotal, otherwise urls_alias[i].
+*/
+static unsigned long long* urls_odds;
+static int* urls_alias;
+
+/* A file of request body, opened once however many URLs send it. */
+typedef struct
+{
+	char* filename;
+	int fd;
+	off_t size;
+#ifdef USE_SSL
+	char* map;	/* SSL can't use sendfile() */
+#endif
+} body;
+static body* bodies;
+static int num_bodies, max_bodies;
+
+/* Extra request headers, each "Name: value\r\n".  Those from -header
+** go on every request; a named set from the url_file goes on the URLs
+** that ask for it, and takes precedence.
+*/
+typedef struct
+{
+	char* name;
+	char* text;
+} header_set;
+static char* extra_headers;
+static header_set* header_sets;
+static int num_header_sets, max_header_sets;
 
 typedef struct
 {
@@ -108,51 +258,184 @@ static int num_sips, max_sips;
 #define PROTO_HTTPS 1
 #endif
 
+/* A request written down a pipelined connection, waiting its turn for
+** a response.
+*/
+typedef struct
+{
+	int url_num;
+	long long scheduled_at;
+	long long request_at;
+	int render_len;
+} pipelined;
+
+/* A connection slot is split in two.  The part looked at for every read
+** and every slot scan is packed into one cache line; the rest, touched
+** once or twice per fetch, lives in a parallel array.
+*/
 typedef struct
 {
 	int url_num;
+	int conn_fd;
+	int num_requests;
+	int pipe_count;
+	int http_status;
+	int checksum;
+	unsigned char conn_state, header_state, chunk_state;
+	char did_response, keep_alive, chunked;
+	unsigned char unsent;	/* requests at the end of the queue not sent */
+	char head;	/* the current response answers a HEAD */
+	long content_length;
+	long chunk_left;
+	long bytes;
+	Timer* idle_timer;
+} __attribute__((aligned(CACHE_LINE))) connection;
+
+typedef struct
+{
+#ifdef USE_IPV6
+	struct sockaddr_in6 sa;
+#else /* USE_IPV6 */
 	struct sockaddr_in sa;
+#endif /* USE_IPV6 */
 	int sa_len;
-	int conn_fd;
+	int host;	/* index into hosts */
 #ifdef USE_SSL
 	SSL* ssl;
+	int early;	/* 1 to send the first request as TLS early data, 2 sent */
 #endif
-	int conn_state, header_state;
-	int did_connect, did_response;
-	struct timeval started_at;
-	struct timeval connect_at;
-	struct timeval request_at;
-	struct timeval response_at;
-	Timer* idle_timer;
+	int did_connect;
+	int prev_idle, next_idle;
+	int prev_host_idle, next_host_idle;	/* the same, just for its host */
+	/* On its host's list of pipelines with room for another request. */
+	int prev_room, next_room;
+	int on_room_list;
+	int next_free;
+	pipelined* pipe;	/* requests behind this one, oldest first */
+	int pipe_first;
+	long send_off;	/* bytes of the first unsent request already sent */
+	/* Rendered request lines, render_max bytes for this request and then
+	** one for each place in pipe.
+	*/
+	char* render;
+	int render_len;
+	/* Timestamps from tmr_now(), in nsecs.  With -rate or -replay,
+	** scheduled_at is when the fetch was due to start, which may be before
+	** started_at.
+	*/
+	long long scheduled_at;
+	long long started_at;
+	long long connect_at;
+	long long handshake_at;	/* TCP is up, the TLS handshake starts */
+	long long request_at;
+	long long response_at;
+	long long done_at;
 	Timer* wakeup_timer;
-	long content_length;
-	long bytes;
-	long checksum;
-	int http_status;
-} connection;
-static connection* connections;
-static int max_connections, num_connections, max_parallel;
-
-static int http_status_counts[1000]; /* room for all three-digit statuses */
+} connection_cold;
+static __thread connection* connections;
+static __thread connection_cold* connections_cold;
+static __thread int max_connections;
+static __thread int idle_head;	/* connections kept alive between fetches */
+static __thread int idle_tail;	/* the one parked longest */
+static __thread int* host_idle_head;	/* per host pool, the same */
+static __thread int free_head;	/* free slots, most recently used first */
+static __thread int* room_head;	/* per host pool, pipelines with room */
+static __thread int num_open;	/* connections with a socket open */
+
+/* A URL's latencies, for -urlpercentiles.  A full set of histograms for
+** every URL could come to gigabytes, so these are small ones; the totals
+** keep full resolution.
+*/
+typedef struct {
+	SmallHistogram connect_hist, first_hist, response_hist;
+} UrlHistograms;
 
 typedef struct {
 	turn_t turn;
 	size_t fetches;
-	struct timeval total_time;
-	struct timeval min_time;
-	struct timeval max_time;
+	long long total_time;	/* nsecs */
+	long long min_time;
+	long long max_time;
 	int http_status;
 	size_t fails;
 	size_t bytes;
 	size_t content_length;
+	int got_bytes;
+	long expected_bytes;
+	int got_checksum;
+	long expected_checksum;
+	UrlHistograms* hists;	/* only with -urlpercentiles */
 } UrlReport;
-static UrlReport* reports;
+
+/* Everything a worker counts.  Each worker owns one of these, and
+** finish() adds them all up.
+*/
+typedef struct
+{
+	int fetches_started, connects_completed, responses_completed,
+	    fetches_completed;
+	int num_connections, max_parallel;
+	long long total_bytes;
+	long long total_connect_nsecs, max_connect_nsecs, min_connect_nsecs;
+	long long total_response_nsecs, max_response_nsecs, min_response_nsecs;
+	long long total_sent_bytes;	/* all of the requests, headers and bodies */
+	int total_timeouts, total_badbytes, total_badchecksums;
+	int http_status_counts[1000]; /* room for all three-digit statuses */
+	/* Request to first byte, and request to last byte, in nsecs. */
+	Histogram connect_hist, first_hist, response_hist;
+	/* First byte to last byte in nsecs, and bytes/sec over that time. */
+	Histogram transfer_hist, throughput_hist;
+	/* With -rate, from when each fetch was due to start to its last byte. */
+	Histogram scheduled_hist;
+	/* Request to the last byte of its body going out, in nsecs. */
+	Histogram upload_hist;
+	/* TLS handshakes, after the TCP connect, in nsecs. */
+	Histogram handshake_hist;
+	int handshakes_resumed, alpn_agreed;
+	int early_accepted, early_rejected;	/* requests sent as early data */
+	UrlReport** reports;	/* per URL, made on its first fetch */
+} stats;
+static __thread stats* st;
+
+/* A worker runs its own event loop, with its own connections and timers,
+** on its share of the load.
+*/
+typedef struct
+{
+	int index;
+	int cpu;
+	int start_parallel, start_rate, end_fetches;
+	int max_connections;
+	pthread_t thread;
+	stats st;
+} worker;
+static worker* workers;
+static int num_workers;
+/* Set by whichever worker ends the run, read by all of them.  Like the
+** counters progress_report() peeks at, it only goes through the
+** __atomic builtins.
+*/
+static int stopping;
+/* Fetches in progress over all the workers, and the most there were at
+** once.  Each worker's own peak comes at a different time, so adding
+** those up would overstate it.
+*/
+static int all_parallel, peak_parallel;
+
+/* Bump a counter that other threads read.  Only its own worker writes
+** it, so a relaxed load and store are enough.
+*/
+#define SHARED_ADD(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+#define SHARED_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
 
 #define CNST_FREE 0
 #define CNST_CONNECTING 1
 #define CNST_HEADERS 2
 #define CNST_READING 3
 #define CNST_PAUSING 4
+#define CNST_IDLE 5
+#define CNST_WRITING 6
+#define CNST_HANDSHAKE 7
 
 #define HDST_LINE1_PROTOCOL 0
 #define HDST_LINE1_WHITESPACE 1
@@ -180,49 +463,213 @@ static UrlReport* reports;
 #define HDST_CONTENT_LENGTH_COLON 34
 #define HDST_CONTENT_LENGTH_COLON_WHITESPACE 35
 #define HDST_CONTENT_LENGTH_COLON_WHITESPACE_NUM 36
+#define HDST_CONN 40
+#define HDST_CONNE 41
+#define HDST_CONNEC 42
+#define HDST_CONNECT 43
+#define HDST_CONNECTI 44
+#define HDST_CONNECTIO 45
+#define HDST_CONNECTION 46
+#define HDST_CONNECTION_COLON 47
+#define HDST_CONNECTION_COLON_WHITESPACE 48
+#define HDST_T 50
+#define HDST_TR 51
+#define HDST_TRA 52
+#define HDST_TRAN 53
+#define HDST_TRANS 54
+#define HDST_TRANSF 55
+#define HDST_TRANSFE 56
+#define HDST_TRANSFER 57
+#define HDST_TRANSFER_ 58
+#define HDST_TRANSFER_E 59
+#define HDST_TRANSFER_EN 60
+#define HDST_TRANSFER_ENC 61
+#define HDST_TRANSFER_ENCO 62
+#define HDST_TRANSFER_ENCOD 63
+#define HDST_TRANSFER_ENCODI 64
+#define HDST_TRANSFER_ENCODIN 65
+#define HDST_TRANSFER_ENCODING 66
+#define HDST_TRANSFER_ENCODING_COLON 67
+#define HDST_TRANSFER_ENCODING_COLON_TOKEN 68
+
+/* States for decoding a chunked body. */
+#define CHST_SIZE 0
+#define CHST_EXT 1
+#define CHST_SIZE_CR 2
+#define CHST_DATA 3
+#define CHST_DATA_CR 4
+#define CHST_DATA_LF 5
+#define CHST_TRAILER_BOL 6
+#define CHST_TRAILER_TEXT 7
+#define CHST_TRAILER_CR 8
+#define CHST_DONE 9
+#define CHST_BAD 10
 
 static char* argv0;
+static int start, end;
+#define START_NONE 0
+#define START_PARALLEL 1
+#define START_RATE 2
+#define START_REPLAY 3
+#define END_NONE 0
+#define END_FETCHES 1
+#define END_SECONDS 2
+static int end_seconds;
 static int do_checksum, do_throttle, do_verbose, do_jitter, do_proxy;
+static int do_keepalive, keepalive_max;
+static int do_url_percentiles;
+static int pipeline_depth;
 static float throttle;
 static int idle_secs;
 static char* proxy_hostname;
 static unsigned short proxy_port;
 
-static struct timeval start_at;
-static int fetches_started, connects_completed, responses_completed,
-    fetches_completed;
-static long long total_bytes;
-static long long total_connect_usecs, max_connect_usecs, min_connect_usecs;
-static long long total_response_usecs, max_response_usecs, min_response_usecs;
-int total_timeouts, total_badbytes, total_badchecksums;
-
-static long start_interval, low_interval, high_interval, range_interval;
-
-static unsigned long wtotal;
+static long long start_at;
+
+/* With -rate, the nsecs between starts and when the next one is due. */
+static __thread long long start_interval, low_interval, range_interval;
+static __thread long long next_start_at;
+static __thread int start_behind;
+/* The start_timer or replay_timer that ran out of slots, to be run again
+** when one opens up rather than on every tick.
+*/
+static __thread TimerProc* start_waiting;
+
+static unsigned long long wtotal;
+
+/* State for fast_random(), one generator per worker. */
+static __thread unsigned long long rng_state;
+
+/* The longest a rendered request line can be, and the next {seq}. */
+static int render_max;
+static __thread unsigned long long seq_next;
+
+/* With -replay the log is mapped, and each worker walks it for every
+** num_workers'th line, parsing each into a URL slot of its own when the
+** one before it has started.  A slot is reused once its fetch is done,
+** so only the fetches in progress take up memory.
+*/
+static char* replay_map;
+static char* replay_end;
+static float replay_speed;
+static double replay_first;	/* the first line's timestamp, in secs */
+static long replay_lines;
+static size_t replay_line_max;	/* longest request line */
+static size_t replay_text_max;	/* longest log line, plus its '\0' */
+static __thread int num_url_slots, max_url_slots;
+static __thread int* free_urls;
+static __thread int num_free_urls;
+static __thread char* replay_next;	/* this worker's next line */
+static __thread int replay_url;	/* parsed and waiting to start, or -1 */
+static __thread long long replay_at;	/* when it's due */
 
 #ifdef USE_SSL
 static SSL_CTX* ssl_ctx = (SSL_CTX*) 0;
-static char* cipher = (char*) 0;
+static char* cipher = (char*) 0;	/* up to TLS 1.2 */
+static char* ciphersuites = (char*) 0;	/* TLS 1.3 */
+static char* groups = (char*) 0;
+static int tls_version;	/* 0 for the best both ends can do */
+static unsigned char* alpn = (unsigned char*) 0;	/* in wire format */
+static unsigned int alpn_len;
+static int do_early_data;
+#define EARLY_DATA_MAX 16384	/* longest request to send that way */
+#define HANDSHAKE_RESUME 0	/* offer the host's last session */
+#define HANDSHAKE_FULL 1	/* a full handshake every time */
+static int handshake_mode;
+/* Each worker keeps the last session every host gave it, by host. */
+static __thread SSL_SESSION** sessions;
 #endif
 
 /* Forwards. */
 static void usage(void);
+static char* map_file(const char* filename, int writable, size_t* sizeP);
+static void init_tables(void);
 static void read_url_file(const char* url_file);
-static void lookup_address(int url_num);
+static void read_replay_file(const char* replay_file);
+static char* parse_url_line(char* line, int url_num);
+static unsigned int hash_bytes(const char* str, int len, unsigned int h);
+static int find_host(int protocol, char* hostname, int host_len,
+    unsigned short port);
+static char* arena_alloc(size_t size);
+static void make_alias_table(void);
+static int open_body(char* filename);
+static int find_header_set(char* name);
+static void add_header(char** textP, char* header);
+static int has_header(char* text, char* name, size_t len);
+static int copy_headers(char* buf, char* text, char* skip);
+static void compile_template(int url_num);
+static void render_request(int cnum, int slot, int url_num);
+static int put_number(char* buf, unsigned long long n);
+static int find_addresses(char* hostname);
+static address_list* lookup_address(char* hostname);
+static void resolve_addresses(void);
+static void* resolver(void* arg);
+static void* reresolver(void* arg);
+static address* pick_address(int set_num);
+static void make_request(int url_num, char* filename);
+static int find_tail(int host_num, int headers, int body_num, int zero_length);
+static void make_tail(int tail_num);
 static void read_sip_file(char* sip_file);
-static void start_connection(struct timeval* nowP);
+static void start_workers(int max_files, int start_parallel, int start_rate,
+    int end_fetches);
+static void* run_worker(void* arg);
+static int start_connection(int url_num, long long scheduled_at,
+    long long* nowP);
 static int pick_url();
-static void start_socket(int url_num, int cnum, struct timeval* nowP);
-static void handle_connect(int cnum, struct timeval* nowP, int double_check);
-static void handle_read(int cnum, struct timeval* nowP);
-static void idle_connection(ClientData client_data, struct timeval* nowP);
-static void wakeup_connection(ClientData client_data, struct timeval* nowP);
-static void close_connection(int cnum);
-static void progress_report(ClientData client_data, struct timeval* nowP);
-static void start_timer(ClientData client_data, struct timeval* nowP);
-static void end_timer(ClientData client_data, struct timeval* nowP);
-static void finish(struct timeval* nowP);
-static long long delta_timeval(struct timeval* start, struct timeval* finish);
+static int next_replay_url(void);
+static int take_url(void);
+static void free_url(int url_num);
+static unsigned long long fast_random(void);
+static void start_fetch(int url_num, int cnum, long long* nowP);
+static void start_socket(int url_num, int cnum, long long scheduled_at,
+    long long* nowP);
+static void handle_connect(int cnum, long long* nowP, int double_check);
+#ifdef USE_SSL
+static void handle_handshake( int cnum, long long* nowP );
+static int write_early_data( int cnum );
+static int new_session( SSL* ssl, SSL_SESSION* session );
+static void ssl_failed( char* what );
+#endif
+static int pipeline_room(int cnum);
+static void update_room(int cnum, int to_front);
+static void pipeline_request(int cnum, int url_num, long long scheduled_at,
+    long long* nowP);
+static void next_request(int cnum, long long* nowP);
+static int queued_url(int cnum, int i);
+static int add_request(struct iovec* iov, int cnum, int i, int last);
+static long header_size(int cnum, int i, int last);
+static long request_size(int cnum, int i, int last);
+static void request_sent(int cnum, int i, long long* nowP);
+static void send_request(int cnum, long long* nowP);
+static void handle_write(int cnum, long long* nowP);
+static void retry_connection(int cnum, long long* nowP);
+static void restart_pipeline(int cnum, long long* nowP);
+static void handle_idle(int cnum);
+static void handle_read(int cnum, long long* nowP);
+static void handle_bytes(int cnum, char* buf, int bytes_read,
+    long long* nowP);
+static int handle_chunk_framing(int cnum, char* buf, int bytes_handled,
+    int bytes_read);
+static void idle_connection(ClientData client_data, long long* nowP);
+static void wakeup_connection(ClientData client_data, long long* nowP);
+static void response_done(int cnum, long long* nowP);
+static void park_connection(int cnum, long long* nowP);
+static void close_connection(int cnum, long long* nowP);
+static void unpark_connection(int cnum);
+static void drop_connection(int cnum);
+static int take_slot(void);
+static void free_slot(int cnum);
+static void slot_opened(void);
+static void count_parallel(int n);
+static UrlReport* url_report(stats* s, int url_num);
+static void record_fetch(int cnum, long long* nowP);
+static void progress_report(ClientData client_data, long long* nowP);
+static void start_timer(ClientData client_data, long long* nowP);
+static void replay_timer(ClientData client_data, long long* nowP);
+static void end_timer(ClientData client_data, long long* nowP);
+static void print_percentiles(char* what, Histogram* h);
+static void merge_stats(stats* total, stats* s);
+static void finish(long long* nowP);
 static void* malloc_check(size_t size);
 static void* realloc_check(void* ptr, size_t size);
 static char* strdup_check(char* str);
@@ -231,28 +678,20 @@ static void check(void* ptr);
 int main(int argc, char** argv)
 {
 	int argn;
-	int start;
-#define START_NONE 0
-#define START_PARALLEL 1
-#define START_RATE 2
 	int start_parallel = -1, start_rate = -1;
-	int end;
-#define END_NONE 0
-#define END_FETCHES 1
-#define END_SECONDS 2
-	int end_fetches = -1, end_seconds = -1;
-	int cnum;
+	int end_fetches = -1;
+	int max_files;
 	char* url_file;
 	char* sip_file;
 #ifdef RLIMIT_NOFILE
 	struct rlimit limits;
 #endif /* RLIMIT_NOFILE */
-	fd_set rfdset;
-	fd_set wfdset;
-	struct timeval now;
-	int i, r;
+#ifdef USE_SSL
+	int i;
+#endif /* USE_SSL */
+	long long now;
 
-	max_connections = 64 - RESERVED_FDS; /* a guess */
+	max_files = 64 - RESERVED_FDS; /* a guess */
 #ifdef RLIMIT_NOFILE
 	/* Try and increase the limit on # of files to the maximum. */
 	if (getrlimit(RLIMIT_NOFILE, &limits) == 0)
@@ -265,19 +704,28 @@ int main(int argc, char** argv)
 				limits.rlim_cur = limits.rlim_max;
 			(void)setrlimit(RLIMIT_NOFILE, &limits);
 		}
-		max_connections = limits.rlim_cur - RESERVED_FDS;
+		max_files = limits.rlim_cur - RESERVED_FDS;
 	}
 #endif /* RLIMIT_NOFILE */
 
+	/* The fd watcher may not be able to handle them all. */
+	max_files = fdwatch_get_nfiles(max_files + RESERVED_FDS) - RESERVED_FDS;
+
 	/* Parse args. */
 	argv0 = argv[0];
 	argn = 1;
 	do_checksum = do_throttle = do_verbose = do_jitter = do_proxy = 0;
+	do_keepalive = keepalive_max = 0;
+	rotate = ROTATE_NONE;
+	resolve_secs = 0;
+	pipeline_depth = 1;
 	throttle = THROTTLE;
 	sip_file = (char*)0;
+	extra_headers = strdup_check("");
 	idle_secs = IDLE_SECS;
 	start = START_NONE;
 	end = END_NONE;
+	num_workers = 1;
 	while (argn < argc && argv[argn][0] == '-' && argv[argn][1] != '\0')
 	{
 		if (strncmp(argv[argn], "-checksum", strlen(argv[argn])) == 0)
@@ -292,6 +740,8 @@ int main(int argc, char** argv)
 		}
 		else if (strncmp(argv[argn], "-verbose", strlen(argv[argn])) == 0)
 			do_verbose = 1;
+		else if (strncmp(argv[argn], "-urlpercentiles", strlen(argv[argn])) == 0)
+			do_url_percentiles = 1;
 		else if (strncmp(argv[argn], "-timeout", strlen(argv[argn])) == 0
 		    && argn + 1 < argc)
 			idle_secs = atoi(argv[++argn]);
@@ -308,10 +758,10 @@ int main(int argc, char** argv)
 				    argv0);
 				exit(1);
 			}
-			if (start_parallel > max_connections)
+			if (start_parallel > max_files)
 			{
 				(void)fprintf(stderr, "%s: parallel may be at most %d\n", argv0,
-				    max_connections);
+				    max_files);
 				exit(1);
 			}
 		}
@@ -325,10 +775,22 @@ int main(int argc, char** argv)
 				(void)fprintf(stderr, "%s: rate must be at least 1\n", argv0);
 				exit(1);
 			}
-			if (start_rate > 1000)
+		}
+		else if (strncmp(argv[argn], "-replay", strlen(argv[argn])) == 0)
+		{
+			start = START_REPLAY;
+			replay_speed = 1.0;
+			/* The speed-up is optional, the log always follows. */
+			if (argn + 2 < argc && (isdigit((unsigned char)argv[argn + 1][0])
+			    || argv[argn + 1][0] == '.'))
 			{
-				(void)fprintf(stderr, "%s: rate may be at most 1000\n", argv0);
-				exit(1);
+				replay_speed = atof(argv[++argn]);
+				if (replay_speed <= 0.0)
+				{
+					(void)fprintf(stderr, "%s: replay speed must be positive\n",
+					    argv0);
+					exit(1);
+				}
 			}
 		}
 		else if (strncmp(argv[argn], "-fetches", strlen(argv[argn])) == 0
@@ -362,12 +824,70 @@ int main(int argc, char** argv)
 		else if ( strncmp( argv[argn], "-cipher", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
 		{
 			cipher = argv[++argn];
+			/* The presets pick for TLS 1.3 too. */
 			if ( strcasecmp( cipher, "fastsec" ) == 0 )
-			cipher = "RC4-MD5";
+			{
+				cipher = "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256";
+				ciphersuites = "TLS_AES_128_GCM_SHA256";
+			}
 			else if ( strcasecmp( cipher, "highsec" ) == 0 )
-			cipher = "DES-CBC3-SHA";
+			{
+				cipher = "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305";
+				ciphersuites = "TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256";
+			}
 			else if ( strcasecmp( cipher, "paranoid" ) == 0 )
-			cipher = "AES256-SHA";
+			{
+				cipher = "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384";
+				ciphersuites = "TLS_AES_256_GCM_SHA384";
+			}
+		}
+		else if ( strncmp( argv[argn], "-ciphersuites", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+			ciphersuites = argv[++argn];
+		else if ( strncmp( argv[argn], "-groups", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+			groups = argv[++argn];
+		else if ( strncmp( argv[argn], "-tls", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+			++argn;
+			if ( strcmp( argv[argn], "1.2" ) == 0 )
+			tls_version = TLS1_2_VERSION;
+			else if ( strcmp( argv[argn], "1.3" ) == 0 )
+			tls_version = TLS1_3_VERSION;
+			else
+			usage();
+		}
+		else if ( strncmp( argv[argn], "-alpn", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+			char* name;
+			int len;
+
+			/* "h2,http/1.1" goes as length-prefixed names. */
+			name = argv[++argn];
+			alpn = (unsigned char*) malloc_check( strlen( name ) + 1 );
+			alpn_len = 0;
+			for (;;)
+			{
+				len = strcspn( name, "," );
+				if ( len < 1 || len > 255 )
+				usage();
+				alpn[alpn_len++] = (unsigned char) len;
+				(void) memcpy( &alpn[alpn_len], name, len );
+				alpn_len += len;
+				if ( name[len] == '\0' )
+				break;
+				name += len + 1;
+			}
+		}
+		else if ( strncmp( argv[argn], "-early-data", strlen( argv[argn] ) ) == 0 )
+			do_early_data = 1;
+		else if ( strncmp( argv[argn], "-handshake", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+			++argn;
+			if ( strcmp( argv[argn], "full" ) == 0 )
+			handshake_mode = HANDSHAKE_FULL;
+			else if ( strcmp( argv[argn], "resume" ) == 0 )
+			handshake_mode = HANDSHAKE_RESUME;
+			else
+			usage();
 		}
 #endif /* USE_SSL */
 		else if (strncmp(argv[argn], "-proxy", strlen(argv[argn])) == 0
@@ -385,150 +905,491 @@ int main(int argc, char** argv)
 				*colon = '\0';
 			}
 		}
+		else if (strncmp(argv[argn], "-rotate", strlen(argv[argn])) == 0
+		    && argn + 1 < argc)
+		{
+			++argn;
+			if (strcmp(argv[argn], "rr") == 0)
+				rotate = ROTATE_RR;
+			else if (strcmp(argv[argn], "random") == 0)
+				rotate = ROTATE_RANDOM;
+			else
+				usage();
+		}
+		else if (strncmp(argv[argn], "-resolve", strlen(argv[argn])) == 0
+		    && argn + 1 < argc)
+		{
+			resolve_secs = atoi(argv[++argn]);
+			if (resolve_secs < 1)
+			{
+				(void)fprintf(stderr, "%s: resolve must be at least 1\n",
+				    argv0);
+				exit(1);
+			}
+		}
+		else if (strncmp(argv[argn], "-header", strlen(argv[argn])) == 0
+		    && argn + 1 < argc)
+			add_header(&extra_headers, argv[++argn]);
+		else if (strncmp(argv[argn], "-keepalive", strlen(argv[argn])) == 0)
+		{
+			do_keepalive = 1;
+			/* The request limit is optional, the url_file always follows. */
+			if (argn + 2 < argc && isdigit((unsigned char)argv[argn + 1][0]))
+				keepalive_max = atoi(argv[++argn]);
+		}
+		else if (strncmp(argv[argn], "-pipeline", strlen(argv[argn])) == 0
+		    && argn + 1 < argc)
+		{
+			do_keepalive = 1;
+			pipeline_depth = atoi(argv[++argn]);
+			if (pipeline_depth < 1)
+			{
+				(void)fprintf(stderr, "%s: pipeline must be at least 1\n",
+				    argv0);
+				exit(1);
+			}
+			if (pipeline_depth > MAX_PIPELINE)
+			{
+				(void)fprintf(stderr, "%s: pipeline may be at most %d\n",
+				    argv0, MAX_PIPELINE);
+				exit(1);
+			}
+		}
+		else if (strncmp(argv[argn], "-threads", strlen(argv[argn])) == 0
+		    && argn + 1 < argc)
+		{
+			num_workers = atoi(argv[++argn]);
+			if (num_workers < 1)
+			{
+				(void)fprintf(stderr, "%s: threads must be at least 1\n",
+				    argv0);
+				exit(1);
+			}
+		}
 		else
 			usage();
 		++argn;
 	}
 	if (argn + 1 != argc)
 		usage();
-	if (start == START_NONE || end == END_NONE)
+	/* A replay ends when the log does, unless told to stop sooner. */
+	if (start == START_NONE || (end == END_NONE && start != START_REPLAY))
 		usage();
 	if (do_jitter && start != START_RATE)
 		usage();
 	url_file = argv[argn];
 
-	/* Read in and parse the URLs. */
-	read_url_file(url_file);
+	/* Read in and parse the URLs, or check over the log to replay. */
+	if (start == START_REPLAY)
+		read_replay_file(url_file);
+	else
+		read_url_file(url_file);
+	/* Now that all the names are in, look them up. */
+	resolve_addresses();
+	/* The body files stay open the whole run. */
+	max_files -= num_bodies;
 
 	/* Read in the source IP file, if specified. */
 	if (sip_file != (char*)0)
 		read_sip_file(sip_file);
 
-	/* Initialize the connections table. */
+	/* Initialize the random number generator. */
+#ifdef HAVE_SRANDOMDEV
+	srandomdev();
+#else
+	srandom((int)time((time_t*)0) ^ getpid());
+#endif
+
+#ifdef USE_SSL
+	/* Set up SSL up front, the workers share the context. */
+	for (i = 0; i < num_hosts; ++i)
+		if ( hosts[i].protocol == PROTO_HTTPS )
+			break;
+	if ( i < num_hosts )
+	{
+		/* OpenSSL sets itself up, and seeds its random numbers from
+		** the system.
+		*/
+		ssl_ctx = SSL_CTX_new( TLS_client_method() );
+		if ( ssl_ctx == (SSL_CTX*) 0 )
+			ssl_failed( "up SSL" );
+		if ( tls_version != 0 )
+		{
+			if ( ! SSL_CTX_set_min_proto_version( ssl_ctx, tls_version )
+			    || ! SSL_CTX_set_max_proto_version( ssl_ctx, tls_version ) )
+				ssl_failed( "TLS version" );
+		}
+		if ( cipher != (char*) 0 && ! SSL_CTX_set_cipher_list( ssl_ctx, cipher ) )
+			ssl_failed( "cipher list" );
+		if ( ciphersuites != (char*) 0
+		    && ! SSL_CTX_set_ciphersuites( ssl_ctx, ciphersuites ) )
+			ssl_failed( "ciphersuites" );
+		if ( groups != (char*) 0 && ! SSL_CTX_set1_groups_list( ssl_ctx, groups ) )
+			ssl_failed( "groups" );
+		/* Unlike the rest, this one returns 0 for success. */
+		if ( alpn != (unsigned char*) 0
+		    && SSL_CTX_set_alpn_protos( ssl_ctx, alpn, alpn_len ) != 0 )
+			ssl_failed( "ALPN protocols" );
+		if ( do_early_data && handshake_mode == HANDSHAKE_FULL )
+		{
+			(void) fprintf(
+				stderr, "%s: early data needs resumed handshakes\n", argv0 );
+			exit( 1 );
+		}
+		/* Sessions get kept by the workers, not in the context's cache,
+		** and are handed over as the server sends them; under TLS 1.3
+		** that's after the handshake.
+		*/
+		if ( handshake_mode == HANDSHAKE_RESUME )
+		{
+			SSL_CTX_set_session_cache_mode(
+				ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE );
+			SSL_CTX_sess_set_new_cb( ssl_ctx, new_session );
+		}
+		else
+		SSL_CTX_set_session_cache_mode( ssl_ctx, SSL_SESS_CACHE_OFF );
+	}
+#endif /* USE_SSL */
+
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	if (resolve_secs > 0)
+	{
+		pthread_t thread;
+		int r;
+
+		r = pthread_create(&thread, (pthread_attr_t*)0, reresolver, (void*)0);
+		if (r != 0)
+		{
+			(void)fprintf(stderr, "%s: pthread_create - %s\n", argv0,
+			    strerror(r));
+			exit(1);
+		}
+		(void)pthread_detach(thread);
+	}
+
+	/* Run the workers; with just one, it runs right here. */
+	tmr_clock_init();
+	start_at = tmr_now();
+	start_workers(max_files, start_parallel, start_rate, end_fetches);
+
+	now = tmr_now();
+	finish(&now);
+
+	/* NOT_REACHED */
+}
+
+static void start_workers(int max_files, int start_parallel, int start_rate,
+    int end_fetches)
+{
+	int w, r;
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t cpus;
+	int ncpus, cpu;
+#endif /* HAVE_SCHED_SETAFFINITY */
+
+	/* Every worker needs something to do. */
 	if (start == START_PARALLEL)
-		max_connections = start_parallel;
-	connections = (connection*)malloc_check(
-	    max_connections * sizeof(connection));
+		num_workers = min( num_workers, start_parallel );
+	else if (start == START_RATE)
+		num_workers = min( num_workers, start_rate );
+	else
+		num_workers = min( num_workers, replay_lines );
+	if (end == END_FETCHES)
+		num_workers = min( num_workers, end_fetches );
+
+	workers = (worker*)malloc_check(num_workers * sizeof(worker));
+	(void)memset((void*)workers, 0, num_workers * sizeof(worker));
+
+#ifdef HAVE_SCHED_SETAFFINITY
+	/* Spread the workers round-robin over the CPUs we may run on. */
+	CPU_ZERO(&cpus);
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+		ncpus = 0;
+	else
+		ncpus = CPU_COUNT(&cpus);
+	cpu = -1;
+#endif /* HAVE_SCHED_SETAFFINITY */
+
+	/* Divide the load up as evenly as possible. */
+	for (w = 0; w < num_workers; ++w)
+	{
+		workers[w].index = w;
+		workers[w].cpu = -1;
+#ifdef HAVE_SCHED_SETAFFINITY
+		if (num_workers > 1 && ncpus > 0)
+		{
+			do
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			while (!CPU_ISSET(cpu, &cpus));
+			workers[w].cpu = cpu;
+		}
+#endif /* HAVE_SCHED_SETAFFINITY */
+		workers[w].start_parallel = start_parallel / num_workers
+		    + (w < start_parallel % num_workers);
+		workers[w].start_rate = start_rate / num_workers
+		    + (w < start_rate % num_workers);
+		workers[w].end_fetches = end_fetches / num_workers
+		    + (w < end_fetches % num_workers);
+		if (start == START_PARALLEL)
+			workers[w].max_connections = workers[w].start_parallel;
+		else
+			workers[w].max_connections = max_files / num_workers;
+	}
+
+	if (num_workers == 1)
+	{
+		(void)run_worker((void*)&workers[0]);
+		return;
+	}
+	for (w = 0; w < num_workers; ++w)
+	{
+		r = pthread_create(&workers[w].thread, (pthread_attr_t*)0, run_worker,
+		    (void*)&workers[w]);
+		if (r != 0)
+		{
+			(void)fprintf(stderr, "%s: pthread_create - %s\n", argv0,
+			    strerror(r));
+			exit(1);
+		}
+	}
+	for (w = 0; w < num_workers; ++w)
+		(void)pthread_join(workers[w].thread, (void**)0);
+}
+
+static void* run_worker(void* arg)
+{
+	worker* w = (worker*)arg;
+	int cnum, i, r, events;
+	long timeout;
+	long long now;
+	char* nl;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+	if (w->cpu >= 0)
+	{
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (r != 0)
+			(void)fprintf(stderr, "%s: pthread_setaffinity_np - %s\n",
+			    argv0, strerror(r));
+	}
+#endif /* HAVE_SCHED_SETAFFINITY */
+
+	/* Set up this worker's fd watcher. */
+	max_connections = w->max_connections;
+	if (fdwatch_init(max_connections + RESERVED_FDS) < 0)
+	{
+		perror("fdwatch_init");
+		exit(1);
+	}
+
+	/* Initialize the connections table. */
+	if (posix_memalign((void**)&connections, CACHE_LINE,
+	    max_connections * sizeof(connection)) != 0)
+		check((void*)0);
+	connections_cold = (connection_cold*)malloc_check(
+	    max_connections * sizeof(connection_cold));
 	for (cnum = 0; cnum < max_connections; ++cnum)
+	{
 		connections[cnum].conn_state = CNST_FREE;
-	num_connections = max_parallel = 0;
+		connections[cnum].idle_timer = (Timer*)0;
+		connections_cold[cnum].wakeup_timer = (Timer*)0;
+		connections_cold[cnum].pipe = (pipelined*)0;
+		connections_cold[cnum].pipe_first = connections[cnum].pipe_count = 0;
+		connections_cold[cnum].on_room_list = 0;
+	}
+	if (pipeline_depth > 1)
+	{
+		/* Room for the requests queued up behind the one being read. */
+		pipelined* pipes = (pipelined*)malloc_check(
+		    max_connections * (pipeline_depth - 1) * sizeof(pipelined));
+		for (cnum = 0; cnum < max_connections; ++cnum)
+			connections_cold[cnum].pipe = &pipes[cnum * (pipeline_depth - 1)];
+	}
+	if (render_max > 0)
+	{
+		/* Rendered requests go straight in here, never a malloc per request. */
+		char* render = (char*)malloc_check(
+		    (size_t)max_connections * pipeline_depth * render_max);
+		for (cnum = 0; cnum < max_connections; ++cnum)
+			connections_cold[cnum].render =
+			    &render[(size_t)cnum * pipeline_depth * render_max];
+	}
+	idle_head = idle_tail = -1;
+	host_idle_head = (int*)malloc_check(num_hosts * sizeof(int));
+	for (i = 0; i < num_hosts; ++i)
+		host_idle_head[i] = -1;
+	/* Hand out the low slots first. */
+	free_head = -1;
+	for (cnum = max_connections - 1; cnum >= 0; --cnum)
+		free_slot(cnum);
+	if (pipeline_depth > 1)
+	{
+		room_head = (int*)malloc_check(num_hosts * sizeof(int));
+		for (i = 0; i < num_hosts; ++i)
+			room_head[i] = -1;
+	}
+	num_open = 0;
 
-	/* Initialize the HTTP status-code histogram. */
-	for (i = 0; i < 1000; ++i)
-		http_status_counts[i] = 0;
+	/* Replaying, URL slots get made as they're needed. */
+	if (start == START_REPLAY)
+	{
+		urls = (url*)0;
+		num_url_slots = max_url_slots = num_free_urls = 0;
+		free_urls = (int*)0;
+	}
+	else
+		urls = url_table;
 
 	/* Initialize the statistics. */
-	fetches_started = 0;
-	connects_completed = 0;
-	responses_completed = 0;
-	fetches_completed = 0;
-	total_bytes = 0;
-	total_connect_usecs = 0;
-	max_connect_usecs = 0;
-	min_connect_usecs = 1000000000L;
-	total_response_usecs = 0;
-	max_response_usecs = 0;
-	min_response_usecs = 1000000000L;
-	total_timeouts = 0;
-	total_badbytes = 0;
-	total_badchecksums = 0;
+	st = &w->st;
+	st->min_connect_nsecs = 1000000000000000LL;
+	st->min_response_nsecs = 1000000000000000LL;
+	st->reports = (UrlReport**)malloc_check(num_urls * sizeof(UrlReport*));
+	(void)memset((void*)st->reports, 0, num_urls * sizeof(UrlReport*));
 
-	/* Initialize the random number generator. */
-#ifdef HAVE_SRANDOMDEV
-	srandomdev();
-#else
-	srandom((int)time((time_t*)0) ^ getpid());
+#ifdef USE_SSL
+	if ( ssl_ctx != (SSL_CTX*) 0 && handshake_mode == HANDSHAKE_RESUME )
+	{
+		sessions = (SSL_SESSION**) malloc_check( num_hosts * sizeof(SSL_SESSION*) );
+		(void) memset( (void*) sessions, 0, num_hosts * sizeof(SSL_SESSION*) );
+	}
 #endif
 
-	/* Initialize the rest. */
+	/* Initialize the rest.  The generator must never be all zeros. */
+	rng_state = ((unsigned long long)random() << 32) ^ (unsigned long long)random()
+	    ^ (unsigned long long)w->index;
+	if (rng_state == 0)
+		rng_state = 1;
+	/* Workers take turns at the {seq} numbers, so none repeat, and start
+	** their round-robins at different addresses.
+	*/
+	seq_next = w->index;
+	address_turn = (unsigned int*)malloc_check(
+	    num_address_sets * sizeof(unsigned int));
+	for (i = 0; i < num_address_sets; ++i)
+		address_turn[i] = w->index;
 	tmr_init();
-	(void)gettimeofday(&now, (struct timezone*)0);
-	start_at = now;
-	if (do_verbose)
+	now = tmr_now();
+	if (do_verbose && w->index == 0)
 		(void)tmr_create(&now, progress_report, JunkClientData,
 		    PROGRESS_SECS * 1000L, 1);
 	if (start == START_RATE)
 	{
-		start_interval = 1000L / start_rate;
+		start_interval = 1000000000LL / w->start_rate;
 		if (do_jitter)
 		{
 			low_interval = start_interval * 9 / 10;
-			high_interval = start_interval * 11 / 10;
-			range_interval = high_interval - low_interval + 1;
+			range_interval = start_interval * 11 / 10 - low_interval + 1;
+		}
+		start_behind = 0;
+		next_start_at = now + start_interval;
+		(void)tmr_create(&now, start_timer, JunkClientData,
+		    (long)(start_interval / 1000000LL), 0);
+	}
+	if (start == START_REPLAY)
+	{
+		/* Skip to this worker's first line. */
+		replay_next = replay_map;
+		for (i = 0; i < w->index && replay_next < replay_end; ++i)
+		{
+			nl = (char*)memchr(replay_next, '\n', replay_end - replay_next);
+			replay_next = nl == (char*)0 ? replay_end : nl + 1;
 		}
-		(void)tmr_create(&now, start_timer, JunkClientData, start_interval,
-		    !do_jitter);
+		replay_url = next_replay_url();
+		(void)tmr_create(&now, replay_timer, JunkClientData, 0L, 0);
 	}
 	if (end == END_SECONDS)
 		(void)tmr_create(&now, end_timer, JunkClientData, end_seconds * 1000L,
 		    0);
-	(void)signal(SIGPIPE, SIG_IGN);
 
 	/* Main loop. */
-	for (;;)
+	while (!SHARED_GET(stopping))
 	{
-		if (end == END_FETCHES && fetches_completed >= end_fetches)
-			finish(&now);
+		if (end == END_FETCHES && st->fetches_completed >= w->end_fetches)
+			break;
+		if (start == START_REPLAY && replay_url == -1
+		    && st->num_connections == 0)
+			break;
 
 		if (start == START_PARALLEL)
 		{
-			/* See if we need to start any new connections; but at most 10. */
+			/* See if we need to start any new connections; but at most 10,
+			** or 10 pipelines' worth.
+			*/
 			for (i = 0;
-			    i < 10 && num_connections < start_parallel
-			        && (end != END_FETCHES || fetches_started < end_fetches);
+			    i < 10 * pipeline_depth
+			        && st->num_connections < w->start_parallel * pipeline_depth
+			        && (end != END_FETCHES
+			            || st->fetches_started < w->end_fetches);
 			    ++i)
 			{
-				start_connection(&now);
-				(void)gettimeofday(&now, (struct timezone*)0);
+				if (start_connection(pick_url(), now, &now) < 0)
+					break;
+				now = tmr_now();
 				tmr_run(&now);
 			}
 		}
 
-		/* Build the fdsets. */
-		FD_ZERO( &rfdset);
-		FD_ZERO( &wfdset);
-		for (cnum = 0; cnum < max_connections; ++cnum)
+		/* Wait for something to happen.  With several workers, wake up
+		** now and then to see if one of the others stopped the run.
+		*/
+		timeout = tmr_mstimeout(&now);
+		if (num_workers > 1
+		    && (timeout == INFTIM || timeout > STOP_CHECK_MSECS))
+			timeout = STOP_CHECK_MSECS;
+		r = fdwatch(timeout);
+		if (__builtin_expect(r < 0, 0))
+		{
+			perror(fdwatch_method());
+			exit(1);
+		}
+		now = tmr_now();
+
+		/* Service only the connections that are ready. */
+		while ((cnum = fdwatch_get_next(&events)) != -1)
 		{
 			switch (connections[cnum].conn_state)
 			{
 			case CNST_CONNECTING:
-				FD_SET( connections[cnum].conn_fd, &wfdset);
+				if (events & FDW_WRITE)
+					handle_connect(cnum, &now, 1);
 				break;
-			case CNST_HEADERS:
-			case CNST_READING:
-				FD_SET( connections[cnum].conn_fd, &rfdset);
-				break;
-			}
-		}
-		r = select(FD_SETSIZE, &rfdset, &wfdset, (fd_set*)0, tmr_timeout(&now));
-		if (__builtin_expect(r < 0, 0))
-		{
-			perror("select");
-			exit(1);
-		}
-		(void)gettimeofday(&now, (struct timezone*)0);
-
-		/* Service them. */
-		for (cnum = 0; cnum < max_connections; ++cnum)
-		{
-			switch (connections[cnum].conn_state)
-			{
-			case CNST_CONNECTING:
-				if (FD_ISSET( connections[cnum].conn_fd, &wfdset ))
-					handle_connect(cnum, &now, 1);
+#ifdef USE_SSL
+			case CNST_HANDSHAKE:
+				handle_handshake(cnum, &now);
 				break;
+#endif
+			case CNST_WRITING:
 			case CNST_HEADERS:
 			case CNST_READING:
-				if (FD_ISSET( connections[cnum].conn_fd, &rfdset ))
+			case CNST_PAUSING:
+				/* Requests still to go out, and responses coming in,
+				** can both happen on a pipelined connection.
+				*/
+				if ((events & FDW_WRITE) && connections[cnum].unsent > 0)
+					handle_write(cnum, &now);
+				if ((events & FDW_READ)
+				    && (connections[cnum].conn_state == CNST_HEADERS
+				        || connections[cnum].conn_state == CNST_READING))
 					handle_read(cnum, &now);
 				break;
+			case CNST_IDLE:
+				if (events & FDW_READ)
+					handle_idle(cnum);
+				break;
 			}
 		}
 		/* And run the timers. */
 		tmr_run(&now);
 	}
 
-	/* NOT_REACHED */
+	tmr_destroy();
+	return (void*)0;
 }
 
 static void usage(void)
@@ -539,225 +1400,698 @@ static void usage(void)
 	    argv0);
 #ifdef USE_SSL
 	(void) fprintf( stderr,
-		"            [-cipher str]\n" );
+		"            [-cipher str] [-ciphersuites str] [-groups list] [-tls 1.2|1.3]\n" );
+	(void) fprintf( stderr,
+		"            [-alpn protocols] [-handshake full|resume] [-early-data]\n" );
 #endif /* USE_SSL */
-	(void)fprintf(stderr, "            -parallel N | -rate N [-jitter]\n");
+	(void)fprintf(stderr, "            [-header 'Name: value' ...] [-keepalive [max_requests]]\n");
+	(void)fprintf(stderr, "            [-pipeline depth] [-threads N] [-rotate rr|random] [-resolve secs]\n");
+	(void)fprintf(stderr, "            [-urlpercentiles]\n");
+	(void)fprintf(stderr, "            -parallel N | -rate N [-jitter] | -replay [speedup]\n");
 	(void)fprintf(stderr, "            -fetches N | -seconds N\n");
-	(void)fprintf(stderr, "            url_file\n");
+	(void)fprintf(stderr, "            url_file | replay_log\n");
 	(void)fprintf(stderr,
-	    "One start specifier, either -parallel or -rate, is required.\n");
+	    "One start specifier, either -parallel, -rate or -replay, is required.\n");
 	(void)fprintf(stderr,
-	    "One end specifier, either -fetches or -seconds, is required.\n");
+	    "One end specifier, either -fetches or -seconds, is required, except with -replay.\n");
 	exit(1);
 }
 
+static char* map_file(const char* filename, int writable, size_t* sizeP)
+{
+	int fd;
+	struct stat sb;
+	char* map;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0)
+	{
+		perror(filename);
+		exit(1);
+	}
+	map = (char*)0;
+	if (sb.st_size > 0)
+	{
+		/* Writable means private, so what gets written stays ours. */
+		map = (char*)mmap((void*)0, sb.st_size,
+		    writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		    writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+		if (map == (char*)MAP_FAILED)
+		{
+			perror(filename);
+			exit(1);
+		}
+		(void)madvise((void*)map, sb.st_size, MADV_SEQUENTIAL);
+	}
+	(void)close(fd);
+	*sizeP = sb.st_size;
+	return map;
+}
+
+static void init_tables(void)
+{
+	wtotal = 0;
+	max_bodies = 10;
+	bodies = (body*)malloc_check(max_bodies * sizeof(body));
+	num_bodies = 0;
+	max_header_sets = 10;
+	header_sets = (header_set*)malloc_check(max_header_sets * sizeof(header_set));
+	num_header_sets = 0;
+	max_hosts = 16;
+	hosts = (host*)malloc_check(max_hosts * sizeof(host));
+	num_hosts = 0;
+	max_tails = 16;
+	tails = (tail*)malloc_check(max_tails * sizeof(tail));
+	num_tails = 0;
+}
+
 static void read_url_file(const char* url_file)
 {
-	FILE* fp;
-	unsigned int weight = 0;
-	char line[5000], hostname[5000];
-	memset(line, 0, sizeof(line));
-	memset(hostname, 0, sizeof(hostname));
-	char* http = "http://";
-	int http_len = strlen(http);
-#ifdef USE_SSL
-	char* https = "https://";
-	int https_len = strlen( https );
-#endif
-	int proto_len, host_len;
+	size_t size;
+	char* map;
+	char* end;
 	char* cp;
+	char* nl;
+	char* weight;
+	long lines;
+
+	/* Map the file and parse it in place.  Private, so the fields can be
+	** cut off where they end; the URLs then point straight into it.
+	*/
+	map = map_file(url_file, 1, &size);
+	end = map + size;
+
+	/* Size the table from the line count, rather than growing it. */
+	lines = 1;
+	for (cp = map; cp < end && (nl = (char*)memchr(cp, '\n', end - cp))
+	    != (char*)0; cp = nl + 1)
+		++lines;
+	max_urls = lines;
+	urls = url_table = (url*)malloc_check(max_urls * sizeof(url));
+	num_urls = 0;
+	init_tables();
 
-	fp = fopen(url_file, "r");
-	if (fp == (FILE*)0)
+	for (cp = map; cp < end; cp = nl + 1)
+	{
+		nl = (char*)memchr(cp, '\n', end - cp);
+		if (nl == (char*)0)
+		{
+			/* No newline at the end, so no room for a '\0' either. */
+			char* last = (char*)malloc_check(end - cp + 1);
+			(void)memcpy(last, cp, end - cp);
+			last[end - cp] = '\0';
+			nl = end;
+			cp = last;
+		}
+		else
+			*nl = '\0';
+		weight = parse_url_line(cp, num_urls);
+		if (weight != (char*)0)
+		{
+			urls[num_urls].weight = atoi(weight);
+			if (urls[num_urls].weight < 0)
+			{
+				(void)fprintf(stderr, "%s: negative weight for %s\n", argv0,
+				    urls[num_urls].url_str);
+				exit(1);
+			}
+			wtotal += urls[num_urls].weight;
+			++num_urls;
+		}
+	}
+
+	if (wtotal == 0)
 	{
-		perror(url_file);
+		(void)fprintf(stderr, "%s: no URLs with any weight in %s\n", argv0,
+		    url_file);
 		exit(1);
 	}
+	/* The alias table and pick_url() count in units of weight times the
+	** number of URLs, which has to fit in 64 bits.
+	*/
+	if (wtotal > ULLONG_MAX / (unsigned long long)num_urls)
+	{
+		(void)fprintf(stderr, "%s: weights in %s add up to too much\n",
+		    argv0, url_file);
+		exit(1);
+	}
+	make_alias_table();
+}
 
-	max_urls = 100;
-	urls = (url*)malloc_check(max_urls * sizeof(url));
-	urls_turn = (turn_t*)malloc_check(max_urls * sizeof(turn_t));
+static void read_replay_file(const char* replay_file)
+{
+	size_t size;
+	char* cp;
+	char* nl;
+	char* text;
+	char* stamp;
+	char* after;
+	size_t len;
+	double t;
+
+	/* The log stays mapped read-only for the workers to walk.  Nothing
+	** from it is kept now, but every line gets parsed, so the hosts,
+	** bodies, header sets and headers are all set up before the run and
+	** a bad line stops us here rather than halfway through.
+	*/
+	replay_map = map_file(replay_file, 0, &size);
+	replay_end = replay_map + size;
+	max_urls = 1;
+	urls = (url*)malloc_check(sizeof(url));
+	urls[0].line = (char*)0;
+	urls[0].segs = (segment*)0;
 	num_urls = 0;
-	wtotal = 0;
-	while (!feof(fp))
+	init_tables();
+	text = (char*)0;
+	replay_lines = 0;
+	for (cp = replay_map; cp < replay_end; cp = nl + 1)
 	{
-		(void)fscanf(fp, "%d\t%s\n", &weight, line);
-		/* Nuke trailing newline. */
-		if (line[strlen(line) - 1] == '\n')
+		nl = (char*)memchr(cp, '\n', replay_end - cp);
+		if (nl == (char*)0)
+			nl = replay_end;
+		len = nl - cp;
+		if (len + 1 > replay_text_max)
 		{
-			line[strlen(line) - 1] = '\0';
+			replay_text_max = len + 1;
+			text = (char*)realloc_check((void*)text, replay_text_max);
 		}
-		wtotal += weight;
-
-		/* Check for room in urls. */
-		if (num_urls >= max_urls)
+		(void)memcpy(text, cp, len);
+		text[len] = '\0';
+		stamp = parse_url_line(text, 0);
+		if (stamp == (char*)0)
+			continue;
+		t = strtod(stamp, &after);
+		if (after == stamp || *after != '\0')
 		{
-			max_urls *= 2;
-			urls = (url*)realloc_check((void*)urls, max_urls * sizeof(url));
-			urls_turn = (turn_t*)realloc_check((void*)urls_turn, max_urls * sizeof(turn_t));
+			(void)fprintf(stderr, "%s: bad timestamp - %s\n", argv0, stamp);
+			exit(1);
 		}
+		if (replay_lines == 0)
+			replay_first = t;
+		++replay_lines;
+	}
+	/* Those pages are only the page cache's, and the workers will fault
+	** them back in as they get to them.
+	*/
+	if (size > 0)
+		(void)madvise((void*)replay_map, size, MADV_DONTNEED);
+	free((void*)text);
+	free((void*)urls[0].line);
+	free((void*)urls[0].segs);
+	free((void*)urls);
+	urls = (url*)0;
+	max_urls = 0;
+
+	if (replay_lines == 0)
+	{
+		(void)fprintf(stderr, "%s: no URLs in %s\n", argv0, replay_file);
+		exit(1);
+	}
+}
 
-		/* Add to table. */
-		urls_turn[num_urls] = wtotal;
-		urls[num_urls].weight = weight;
-		urls[num_urls].url_str = strdup_check(line);
+static char* parse_url_line(char* line, int url_num)
+{
+	char* field[5];
+	int num_fields, f, h, proto_len, protocol;
+	unsigned short port;
+	char* hostname;
+	int host_len;
+	char* filename;
+	char* cp;
+	url* u;
 
-		/* Parse it. */
-		if (strncmp(http, line, http_len) == 0)
+	/* "@name Header: value" adds a header to a named set. */
+	if (line[0] == '@')
+	{
+		cp = line + strcspn(line, " \t\r");
+		if (*cp != '\0')
+			*cp++ = '\0';
+		cp[strcspn(cp, "\r")] = '\0';
+		h = find_header_set(line + 1);
+		if (h == -1)
 		{
-			proto_len = http_len;
-			urls[num_urls].protocol = PROTO_HTTP;
+			if (num_header_sets >= max_header_sets)
+			{
+				max_header_sets *= 2;
+				header_sets = (header_set*)realloc_check((void*)header_sets,
+				    max_header_sets * sizeof(header_set));
+			}
+			h = num_header_sets++;
+			header_sets[h].name = strdup_check(line + 1);
+			header_sets[h].text = strdup_check("");
 		}
-#ifdef USE_SSL
-		else if ( strncmp( https, line, https_len ) == 0 )
+		add_header(&header_sets[h].text, cp + strspn(cp, " \t"));
+		return (char*)0;
+	}
+
+	/* The weight, or replaying the timestamp, and URL, then optionally
+	** "@name" to add a header set, the method and a file to send as the
+	** request body.  The first field is left to the caller.
+	*/
+	num_fields = 0;
+	for (cp = line; num_fields < 5; )
+	{
+		cp += strspn(cp, " \t\r");
+		if (*cp == '\0')
+			break;
+		field[num_fields++] = cp;
+		cp += strcspn(cp, " \t\r");
+		if (*cp == '\0')
+			break;
+		*cp++ = '\0';
+	}
+	if (num_fields < 2)
+		return (char*)0;
+
+	u = &urls[url_num];
+	u->url_str = field[1];
+	u->headers = -1;
+	f = 2;
+	if (f < num_fields && field[f][0] == '@')
+	{
+		u->headers = find_header_set(field[f] + 1);
+		if (u->headers == -1)
 		{
-			proto_len = https_len;
-			urls[num_urls].protocol = PROTO_HTTPS;
+			(void)fprintf(stderr, "%s: unknown header set - %s\n", argv0,
+			    field[f]);
+			exit(1);
 		}
+		++f;
+	}
+	u->method = f < num_fields ? field[f] : "GET";
+	++f;
+	u->body = f < num_fields ? open_body(field[f]) : -1;
+
+	/* Parse it. */
+	if (strncmp(u->url_str, "http://", 7) == 0)
+	{
+		proto_len = 7;
+		protocol = PROTO_HTTP;
+	}
+#ifdef USE_SSL
+	else if ( strncmp( u->url_str, "https://", 8 ) == 0 )
+	{
+		proto_len = 8;
+		protocol = PROTO_HTTPS;
+	}
 #endif
+	else
+	{
+		(void)fprintf(stderr, "%s: unknown protocol - %s\n", argv0, u->url_str);
+		exit(1);
+	}
+	hostname = u->url_str + proto_len;
+	host_len = strcspn(hostname, ":/");
+	cp = hostname + host_len;
+	if (*cp == ':')
+	{
+		port = (unsigned short)atoi(++cp);
+		cp += strcspn(cp, "/");
+	}
+	else
+#ifdef USE_SSL
+		if ( protocol == PROTO_HTTPS )
+		port = 443;
 		else
+		port = 80;
+#else
+		port = 80;
+#endif
+	filename = *cp == '\0' ? "/" : cp;
+
+	u->host = find_host(protocol, hostname, host_len, port);
+	make_request(url_num, filename);
+	return field[0];
+}
+
+static unsigned int hash_bytes(const char* str, int len, unsigned int h)
+{
+	/* FNV-1a, folding into whatever came before. */
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*str++) * 16777619U;
+	return h;
+}
+
+static int find_host(int protocol, char* hostname, int host_len,
+    unsigned short port)
+{
+	static int proxy_pools[2] = { -1, -1 };	/* by protocol */
+	unsigned int h, g, i;
+	int n, j;
+
+	h = hash_bytes(hostname, host_len, 2166136261U ^ port ^ (protocol << 16));
+	if (host_hash_size > 0)
+		for (i = h & (host_hash_size - 1); (n = host_hash[i]) != -1;
+		    i = (i + 1) & (host_hash_size - 1))
+			if (hosts[n].port == port && hosts[n].protocol == protocol
+			    && strncmp(hosts[n].hostname, hostname, host_len) == 0
+			    && hosts[n].hostname[host_len] == '\0')
+				return n;
+
+	/* A new one.  Only adding a host grows the hash table, so once
+	** they're all in, lookups change nothing and workers can share it.
+	*/
+	if ((num_hosts + 1) * 2 > host_hash_size)
+	{
+		host_hash_size = host_hash_size == 0 ? 64 : host_hash_size * 2;
+		free((void*)host_hash);
+		host_hash = (int*)malloc_check(host_hash_size * sizeof(int));
+		for (i = 0; i < host_hash_size; ++i)
+			host_hash[i] = -1;
+		for (j = 0; j < num_hosts; ++j)
 		{
-			(void)fprintf(stderr, "%s: unknown protocol - %s\n", argv0, line);
-			exit(1);
+			g = hash_bytes(hosts[j].hostname, strlen(hosts[j].hostname),
+			    2166136261U ^ hosts[j].port ^ (hosts[j].protocol << 16));
+			for (i = g & (host_hash_size - 1); host_hash[i] != -1;
+			    i = (i + 1) & (host_hash_size - 1))
+				;
+			host_hash[i] = j;
 		}
-		for (cp = line + proto_len; *cp != '\0' && *cp != ':' && *cp != '/';
-		    ++cp)
-			;
-		host_len = cp - line;
-		host_len -= proto_len;
-		strncpy(hostname, line + proto_len, host_len);
-		hostname[host_len] = '\0';
-		urls[num_urls].hostname = strdup_check(hostname);
-		if (*cp == ':')
+	}
+
+	for (i = h & (host_hash_size - 1); host_hash[i] != -1;
+	    i = (i + 1) & (host_hash_size - 1))
+		;
+	if (num_hosts >= max_hosts)
+	{
+		max_hosts *= 2;
+		hosts = (host*)realloc_check((void*)hosts, max_hosts * sizeof(host));
+	}
+	n = num_hosts++;
+	host_hash[i] = n;
+	hosts[n].hostname = arena_alloc(host_len + 1);
+	(void)memcpy(hosts[n].hostname, hostname, host_len);
+	hosts[n].hostname[host_len] = '\0';
+	hosts[n].port = port;
+	hosts[n].protocol = protocol;
+	hosts[n].pool = n;
+	if (do_proxy)
+	{
+		if (proxy_pools[protocol] == -1)
+			proxy_pools[protocol] = n;
+		hosts[n].pool = proxy_pools[protocol];
+	}
+	/* Through a proxy they all go to the same place. */
+	hosts[n].addresses = find_addresses(do_proxy ? proxy_hostname
+	    : hosts[n].hostname);
+	return n;
+}
+
+static char* arena_alloc(size_t size)
+{
+	static char* block;
+	static size_t left;
+	char* p;
+
+	/* Carve small, permanent allocations out of big blocks.  Sizes are
+	** rounded up to keep everything pointer aligned.
+	*/
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	if (size > left)
+	{
+		left = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+		block = (char*)malloc_check(left);
+	}
+	p = block;
+	block += size;
+	left -= size;
+	return p;
+}
+
+static int open_body(char* filename)
+{
+	struct stat sb;
+	int b;
+
+	for (b = 0; b < num_bodies; ++b)
+		if (strcmp(bodies[b].filename, filename) == 0)
+			return b;
+
+	if (num_bodies >= max_bodies)
+	{
+		max_bodies *= 2;
+		bodies = (body*)realloc_check((void*)bodies, max_bodies * sizeof(body));
+	}
+	bodies[b].filename = strdup_check(filename);
+	bodies[b].fd = open(filename, O_RDONLY);
+	if (bodies[b].fd < 0 || fstat(bodies[b].fd, &sb) < 0)
+	{
+		perror(filename);
+		exit(1);
+	}
+	bodies[b].size = sb.st_size;
+#ifdef USE_SSL
+	bodies[b].map = (char*) 0;
+	if ( bodies[b].size > 0 )
+	{
+		bodies[b].map = (char*) mmap(
+			(void*) 0, bodies[b].size, PROT_READ, MAP_SHARED, bodies[b].fd, 0 );
+		if ( bodies[b].map == (char*) MAP_FAILED )
 		{
-			urls[num_urls].port = (unsigned short)atoi(++cp);
-			while (*cp != '\0' && *cp != '/')
-				++cp;
+			perror( filename );
+			exit( 1 );
 		}
-		else
-#ifdef USE_SSL
-			if ( urls[num_urls].protocol == PROTO_HTTPS )
-			urls[num_urls].port = 443;
-			else
-			urls[num_urls].port = 80;
-#else
-			urls[num_urls].port = 80;
-#endif
-		if (*cp == '\0')
-			urls[num_urls].filename = strdup_check("/");
-		else
-			urls[num_urls].filename = strdup_check(cp);
+	}
+#endif /* USE_SSL */
+	++num_bodies;
+	return b;
+}
+
+static int find_header_set(char* name)
+{
+	int h;
 
-		lookup_address(num_urls);
+	for (h = 0; h < num_header_sets; ++h)
+		if (strcmp(header_sets[h].name, name) == 0)
+			return h;
+	return -1;
+}
 
-		urls[num_urls].got_bytes = 0;
-		urls[num_urls].got_checksum = 0;
-		++num_urls;
+static void add_header(char** textP, char* header)
+{
+	char* colon;
+	size_t len;
+
+	/* It has to look like one, or the request comes out garbled. */
+	colon = strchr(header, ':');
+	if (colon == (char*)0 || colon == header
+	    || strcspn(header, " \t") < colon - header
+	    || strpbrk(header, "\r\n") != (char*)0)
+	{
+		(void)fprintf(stderr, "%s: bad header - %s\n", argv0, header);
+		exit(1);
 	}
+	len = strlen(*textP);
+	*textP = (char*)realloc_check((void*)*textP, len + strlen(header) + 3);
+	(void)sprintf(*textP + len, "%s\r\n", header);
+}
 
-	reports = (UrlReport*)calloc(num_urls, sizeof(UrlReport));
+static int has_header(char* text, char* name, size_t len)
+{
+	/* Look for a line that starts "name:", any case. */
+	for (; *text != '\0'; text = strstr(text, "\r\n") + 2)
+		if (strncasecmp(text, name, len) == 0 && text[len] == ':')
+			return 1;
+	return 0;
 }
 
-static void lookup_address(int url_num)
+static int copy_headers(char* buf, char* text, char* skip)
 {
-	char* hostname;
-	unsigned short port;
+	char* end;
+	int bytes;
+
+	/* Copy the lines of text into buf, less any skip also has. */
+	bytes = 0;
+	for (; *text != '\0'; text = end + 2)
+	{
+		end = strstr(text, "\r\n");
+		if (skip != (char*)0 && has_header(skip, text, strcspn(text, ":")))
+			continue;
+		(void)memcpy(&buf[bytes], text, end + 2 - text);
+		bytes += end + 2 - text;
+	}
+	return bytes;
+}
+
+static void make_alias_table(void)
+{
+	unsigned long long* odds;
+	int* work;
+	int i, s, l, num_small, num_large;
+
+	/* Vose's method, in whole numbers so the odds come out exact.  Each
+	** URL gets weight * num_urls units, and each column holds wtotal of
+	** them: a URL short of that gets topped up from one with too many.
+	*/
+	urls_odds = (unsigned long long*)malloc_check(
+	    num_urls * sizeof(unsigned long long));
+	urls_alias = (int*)malloc_check(num_urls * sizeof(int));
+	odds = (unsigned long long*)malloc_check(
+	    num_urls * sizeof(unsigned long long));
+	/* The short ones fill from the front, the overfull from the back. */
+	work = (int*)malloc_check(num_urls * sizeof(int));
+	num_small = num_large = 0;
+	for (i = 0; i < num_urls; ++i)
+	{
+		odds[i] = (unsigned long long)urls[i].weight * num_urls;
+		if (odds[i] < wtotal)
+			work[num_small++] = i;
+		else
+			work[num_urls - ++num_large] = i;
+	}
+	while (num_small > 0 && num_large > 0)
+	{
+		s = work[--num_small];
+		l = work[num_urls - num_large];
+		urls_odds[s] = odds[s];
+		urls_alias[s] = l;
+		odds[l] -= wtotal - odds[s];
+		if (odds[l] < wtotal)
+		{
+			--num_large;
+			work[num_small++] = l;
+		}
+	}
+	/* What's left is full. */
+	while (num_large > 0)
+	{
+		l = work[num_urls - num_large--];
+		urls_odds[l] = wtotal;
+		urls_alias[l] = l;
+	}
+	while (num_small > 0)
+	{
+		s = work[--num_small];
+		urls_odds[s] = wtotal;
+		urls_alias[s] = s;
+	}
+	free((void*)odds);
+	free((void*)work);
+}
+
+static int find_addresses(char* hostname)
+{
+	unsigned int h, g, i;
+	int n, j;
+
+	/* Looked up by name alone, so every port and protocol on a host
+	** shares one lookup.
+	*/
+	h = hash_bytes(hostname, strlen(hostname), 2166136261U);
+	if (address_hash_size > 0)
+		for (i = h & (address_hash_size - 1); (n = address_hash[i]) != -1;
+		    i = (i + 1) & (address_hash_size - 1))
+			if (strcmp(address_sets[n].hostname, hostname) == 0)
+				return n;
+
+	/* A new one.  As with hosts, only adding one grows the table. */
+	if ((num_address_sets + 1) * 2 > address_hash_size)
+	{
+		address_hash_size = address_hash_size == 0 ? 64 : address_hash_size * 2;
+		free((void*)address_hash);
+		address_hash = (int*)malloc_check(address_hash_size * sizeof(int));
+		for (i = 0; i < address_hash_size; ++i)
+			address_hash[i] = -1;
+		for (j = 0; j < num_address_sets; ++j)
+		{
+			g = hash_bytes(address_sets[j].hostname,
+			    strlen(address_sets[j].hostname), 2166136261U);
+			for (i = g & (address_hash_size - 1); address_hash[i] != -1;
+			    i = (i + 1) & (address_hash_size - 1))
+				;
+			address_hash[i] = j;
+		}
+	}
+	for (i = h & (address_hash_size - 1); address_hash[i] != -1;
+	    i = (i + 1) & (address_hash_size - 1))
+		;
+	if (num_address_sets >= max_address_sets)
+	{
+		max_address_sets = max_address_sets == 0 ? 16 : max_address_sets * 2;
+		address_sets = (address_set*)realloc_check((void*)address_sets,
+		    max_address_sets * sizeof(address_set));
+	}
+	n = num_address_sets++;
+	address_hash[i] = n;
+	address_sets[n].hostname = hostname;
+	address_sets[n].list = (address_list*)0;	/* by resolve_addresses() */
+	return n;
+}
+
+static address_list* lookup_address(char* hostname)
+{
+	address_list* list;
+	address* a;
 #ifdef USE_IPV6
 	struct addrinfo hints;
-	char portstr[10];
 	int gaierr;
 	struct addrinfo* ai;
 	struct addrinfo* ai2;
-	struct addrinfo* aiv4;
-	struct addrinfo* aiv6;
+	int family, n;
 #else /* USE_IPV6 */
 	struct hostent *he;
+	int n;
 #endif /* USE_IPV6 */
 
-	urls[url_num].sa_len = sizeof(urls[url_num].sa);
-	(void)memset((void*)&urls[url_num].sa, 0, urls[url_num].sa_len);
-
-	if (do_proxy)
-	{
-		hostname = proxy_hostname;
-		port = proxy_port;
-	}
-	else
-	{
-		hostname = urls[url_num].hostname;
-		port = urls[url_num].port;
-	}
+	/* Failing says so and returns null; at startup that's the end, but
+	** a later lookup just keeps the old addresses.
+	*/
 
 #ifdef USE_IPV6
 
+	/* No port, that's filled in for each connection. */
 	(void)memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
-	(void)snprintf(portstr, sizeof(portstr), "%d", (int)port);
-	if ((gaierr = getaddrinfo(hostname, portstr, &hints, &ai)) != 0)
+	if ((gaierr = getaddrinfo(hostname, (char*)0, &hints, &ai)) != 0)
 	{
 		(void)fprintf(stderr, "%s: getaddrinfo %s - %s\n", argv0, hostname,
 		    gai_strerror(gaierr));
-		exit(1);
+		return (address_list*)0;
 	}
 
-	/* Find the first IPv4 and IPv6 entries. */
-	aiv4 = (struct addrinfo*)0;
-	aiv6 = (struct addrinfo*)0;
+	/* Keep every address, IPv4 ones if there are any, otherwise IPv6. */
+	family = AF_INET6;
+	n = 0;
 	for (ai2 = ai; ai2 != (struct addrinfo*)0; ai2 = ai2->ai_next)
 	{
-		switch (ai2->ai_family)
-		{
-		case AF_INET:
-			if (aiv4 == (struct addrinfo*)0)
-				aiv4 = ai2;
-			break;
-		case AF_INET6:
-			if (aiv6 == (struct addrinfo*)0)
-				aiv6 = ai2;
-			break;
-		}
+		if (ai2->ai_family == AF_INET)
+			family = AF_INET;
+		++n;
 	}
-
-	/* If there's an IPv4 address, use that, otherwise try IPv6. */
-	if (aiv4 != (struct addrinfo*)0)
+	list = (address_list*)malloc_check(sizeof(address_list)
+	    + n * sizeof(address));
+	list->addrs = (address*)(list + 1);
+	list->num_addrs = 0;
+	for (ai2 = ai; ai2 != (struct addrinfo*)0; ai2 = ai2->ai_next)
 	{
-		if (sizeof(urls[url_num].sa) < aiv4->ai_addrlen)
+		if (ai2->ai_family != family)
+			continue;
+		a = &list->addrs[list->num_addrs];
+		if (sizeof(a->sa) < ai2->ai_addrlen)
 		{
 			(void)fprintf(stderr, "%s - sockaddr too small (%lu < %lu)\n",
-			    hostname, (unsigned long)sizeof(urls[url_num].sa),
-			    (unsigned long)aiv4->ai_addrlen);
+			    hostname, (unsigned long)sizeof(a->sa),
+			    (unsigned long)ai2->ai_addrlen);
 			exit(1);
 		}
-		urls[url_num].sock_family = aiv4->ai_family;
-		urls[url_num].sock_type = aiv4->ai_socktype;
-		urls[url_num].sock_protocol = aiv4->ai_protocol;
-		urls[url_num].sa_len = aiv4->ai_addrlen;
-		(void)memmove(&urls[url_num].sa, aiv4->ai_addr, aiv4->ai_addrlen);
-		freeaddrinfo(ai);
-		return;
+		(void)memset((void*)&a->sa, 0, sizeof(a->sa));
+		a->sock_family = ai2->ai_family;
+		a->sock_type = ai2->ai_socktype;
+		a->sock_protocol = ai2->ai_protocol;
+		a->sa_len = ai2->ai_addrlen;
+		(void)memmove(&a->sa, ai2->ai_addr, ai2->ai_addrlen);
+		++list->num_addrs;
 	}
-	if (aiv6 != (struct addrinfo*)0)
+	freeaddrinfo(ai);
+	if (list->num_addrs == 0)
 	{
-		if (sizeof(urls[url_num].sa) < aiv6->ai_addrlen)
-		{
-			(void)fprintf(stderr, "%s - sockaddr too small (%lu < %lu)\n",
-			    hostname, (unsigned long)sizeof(urls[url_num].sa),
-			    (unsigned long)aiv6->ai_addrlen);
-			exit(1);
-		}
-		urls[url_num].sock_family = aiv6->ai_family;
-		urls[url_num].sock_type = aiv6->ai_socktype;
-		urls[url_num].sock_protocol = aiv6->ai_protocol;
-		urls[url_num].sa_len = aiv6->ai_addrlen;
-		(void)memmove(&urls[url_num].sa, aiv6->ai_addr, aiv6->ai_addrlen);
-		freeaddrinfo(ai);
-		return;
+		(void)fprintf(stderr, "%s: no valid address found for host %s\n",
+		    argv0, hostname);
+		free((void*)list);
+		return (address_list*)0;
 	}
-
-	(void)fprintf(stderr, "%s: no valid address found for host %s\n", argv0,
-	    hostname);
-	exit(1);
+	return list;
 
 #else /* USE_IPV6 */
 
@@ -765,130 +2099,682 @@ static void lookup_address(int url_num)
 	if ( he == (struct hostent*) 0 )
 	{
 		(void) fprintf( stderr, "%s: unknown host - %s\n", argv0, hostname );
-		exit( 1 );
+		return (address_list*) 0;
 	}
-	urls[url_num].sock_family = urls[url_num].sa.sin_family = he->h_addrtype;
-	urls[url_num].sock_type = SOCK_STREAM;
-	urls[url_num].sock_protocol = 0;
-	urls[url_num].sa_len = sizeof(urls[url_num].sa);
-	(void) memmove( &urls[url_num].sa.sin_addr, he->h_addr, he->h_length );
-	urls[url_num].sa.sin_port = htons( port );
+	for ( n = 0; he->h_addr_list[n] != (char*) 0; ++n )
+		;
+	list = (address_list*) malloc_check(
+		sizeof(address_list) + n * sizeof(address) );
+	list->addrs = (address*) ( list + 1 );
+	list->num_addrs = n;
+	for ( n = 0; n < list->num_addrs; ++n )
+	{
+		a = &list->addrs[n];
+		(void) memset( (void*) &a->sa, 0, sizeof(a->sa) );
+		a->sock_family = a->sa.sin_family = he->h_addrtype;
+		a->sock_type = SOCK_STREAM;
+		a->sock_protocol = 0;
+		a->sa_len = sizeof(a->sa);
+		(void) memmove( &a->sa.sin_addr, he->h_addr_list[n], he->h_length );
+	}
+	return list;
 
 #endif /* USE_IPV6 */
 
 }
 
-static void read_sip_file(char* sip_file)
+static void resolve_addresses(void)
 {
-	FILE* fp;
-	char line[5000];
-
-	fp = fopen(sip_file, "r");
-	if (fp == (FILE*)0)
+	pthread_t threads[RESOLVERS];
+	int n, t, r;
+
+	/* Fan the lookups out over a few threads, so a url_file naming
+	** thousands of hosts waits on DNS round trips side by side rather
+	** than one after another.  gethostbyname() isn't reentrant, so
+	** without getaddrinfo() it's just the one.
+	*/
+	next_to_resolve = 0;
+#ifdef USE_IPV6
+	n = min( RESOLVERS, num_address_sets );
+#else /* USE_IPV6 */
+	n = 1;
+#endif /* USE_IPV6 */
+	if (n <= 1)
 	{
-		perror(sip_file);
-		exit(1);
+		(void)resolver((void*)0);
+		return;
 	}
-
-	max_sips = 100;
-	sips = (sip*)malloc_check(max_sips * sizeof(sip));
-	num_sips = 0;
-	while (fgets(line, sizeof(line), fp) != (char*)0)
+	for (t = 0; t < n; ++t)
 	{
-		/* Nuke trailing newline. */
-		if (line[strlen(line) - 1] == '\n')
-			line[strlen(line) - 1] = '\0';
-
-		/* Check for room in sips. */
-		if (num_sips >= max_sips)
-		{
-			max_sips *= 2;
-			sips = (sip*)realloc_check((void*)sips, max_sips * sizeof(sip));
-		}
-
-		/* Add to table. */
-		sips[num_sips].str = strdup_check(line);
-		(void)memset((void*)&sips[num_sips].sa, 0, sizeof(sips[num_sips].sa));
-		if (!inet_aton(sips[num_sips].str, &sips[num_sips].sa.sin_addr))
+		r = pthread_create(&threads[t], (pthread_attr_t*)0, resolver,
+		    (void*)0);
+		if (r != 0)
 		{
-			(void)fprintf(stderr, "%s: cannot convert source IP address %s\n",
-			    argv0, sips[num_sips].str);
+			(void)fprintf(stderr, "%s: pthread_create - %s\n", argv0,
+			    strerror(r));
 			exit(1);
 		}
-		++num_sips;
 	}
+	for (t = 0; t < n; ++t)
+		(void)pthread_join(threads[t], (void**)0);
 }
 
-static void start_connection(struct timeval* nowP)
+static void* resolver(void* arg)
 {
-	int cnum, url_num;
+	int set_num;
+	address_list* list;
 
-	/* Find an empty connection slot. */
-	for (cnum = 0; cnum < max_connections; ++cnum)
+	while ((set_num = __atomic_fetch_add(&next_to_resolve, 1,
+	    __ATOMIC_RELAXED)) < num_address_sets)
 	{
-		if (__builtin_expect(connections[cnum].conn_state == CNST_FREE, 1))
-		{
-			/* Choose a URL. */
-			url_num = pick_url();
-			/* Start the socket. */
-			start_socket(url_num, cnum, nowP);
-			if (connections[cnum].conn_state != CNST_FREE)
-			{
-				++num_connections;
-				if (num_connections > max_parallel)
-					max_parallel = num_connections;
-			}
-			++fetches_started;
-			return;
-		}
+		list = lookup_address(address_sets[set_num].hostname);
+		if (list == (address_list*)0)
+			exit(1);
+		address_sets[set_num].list = list;
 	}
-	/* No slots left. */
-	(void)fprintf(stderr, "%s: ran out of connection slots\n", argv0);
-	finish(nowP);
+	return (void*)0;
+}
+
+static void* reresolver(void* arg)
+{
+	address_list** old;
+	address_list* list;
+	address_list* cur;
+	int i;
+
+	/* Look every name up again now and then, so the run follows DNS
+	** changes such as a failover.  The workers may be connecting with a
+	** list as it's replaced, so a replaced one is freed only after
+	** another round, long after they're done with it.
+	*/
+	old = (address_list**)malloc_check(
+	    num_address_sets * sizeof(address_list*));
+	(void)memset((void*)old, 0, num_address_sets * sizeof(address_list*));
+	for (;;)
+	{
+		(void)sleep(resolve_secs);
+		for (i = 0; i < num_address_sets; ++i)
+		{
+			list = lookup_address(address_sets[i].hostname);
+			if (list == (address_list*)0)
+				continue;
+			cur = address_sets[i].list;
+			if (list->num_addrs == cur->num_addrs
+			    && memcmp((void*)list->addrs, (void*)cur->addrs,
+			    list->num_addrs * sizeof(address)) == 0)
+			{
+				free((void*)list);
+				continue;
+			}
+			free((void*)old[i]);
+			old[i] = cur;
+			__atomic_store_n(&address_sets[i].list, list, __ATOMIC_RELEASE);
+			if (do_verbose)
+				(void)fprintf(stderr, "%s: %s now has %d address%s\n", argv0,
+				    address_sets[i].hostname, list->num_addrs,
+				    list->num_addrs == 1 ? "" : "es");
+		}
+	}
+	/* NOT_REACHED */
+	return (void*)0;
+}
+
+static void make_request(int url_num, char* filename)
+{
+	char* protocol;
+	char* scheme;
+	char port[20];
+	size_t size;
+	int zero_length;
+
+	/* Just the request line is the URL's own. */
+	protocol = do_keepalive ? "HTTP/1.1" : "HTTP/1.0";
+#ifdef USE_SSL
+	scheme = hosts[urls[url_num].host].protocol == PROTO_HTTPS ? "https" : "http";
+#else
+	scheme = "http";
+#endif
+	(void)snprintf(port, sizeof(port), ":%d", (int)hosts[urls[url_num].host].port);
+	size = strlen(urls[url_num].method) + strlen(filename)
+	    + strlen(hosts[urls[url_num].host].hostname) + 50;
+	if (start != START_REPLAY)
+		urls[url_num].line = arena_alloc(size);
+	else
+	{
+		/* A replay slot's line buffer is as big as the longest line in
+		** the log, which only checking the log over can find.
+		*/
+		if (size > replay_line_max)
+		{
+			replay_line_max = size;
+			urls[url_num].line = (char*)realloc_check(
+			    (void*)urls[url_num].line, size);
+		}
+		free((void*)urls[url_num].segs);
+	}
+	if (do_proxy)
+		urls[url_num].line_len = snprintf(urls[url_num].line, size,
+		    "%s %s://%s%s%s %s\r\n", urls[url_num].method, scheme,
+		    hosts[urls[url_num].host].hostname, port, filename, protocol);
+	else
+		urls[url_num].line_len = snprintf(urls[url_num].line, size,
+		    "%s %s %s\r\n", urls[url_num].method, filename, protocol);
+	compile_template(url_num);
+
+	/* The headers are the same for every URL on the host with the same
+	** header set and body, so they get shared.
+	*/
+	zero_length = urls[url_num].body == -1
+	    && strcmp(urls[url_num].method, "GET") != 0
+	    && strcmp(urls[url_num].method, "HEAD") != 0;
+	urls[url_num].tail = find_tail(urls[url_num].host, urls[url_num].headers,
+	    urls[url_num].body, zero_length);
+}
+
+static int find_tail(int host_num, int headers, int body_num, int zero_length)
+{
+	unsigned int h, g, i;
+	int key[4];
+	int n, j;
+
+	key[0] = host_num;
+	key[1] = headers;
+	key[2] = body_num;
+	key[3] = zero_length;
+	h = hash_bytes((char*)key, sizeof(key), 2166136261U);
+	if (tail_hash_size > 0)
+		for (i = h & (tail_hash_size - 1); (n = tail_hash[i]) != -1;
+		    i = (i + 1) & (tail_hash_size - 1))
+			if (memcmp(tails[n].key, key, sizeof(key)) == 0)
+				return n;
+
+	/* As with hosts, only adding one grows the table. */
+	if ((num_tails + 1) * 2 > tail_hash_size)
+	{
+		tail_hash_size = tail_hash_size == 0 ? 64 : tail_hash_size * 2;
+		free((void*)tail_hash);
+		tail_hash = (int*)malloc_check(tail_hash_size * sizeof(int));
+		for (i = 0; i < tail_hash_size; ++i)
+			tail_hash[i] = -1;
+		for (j = 0; j < num_tails; ++j)
+		{
+			g = hash_bytes((char*)tails[j].key, sizeof(tails[j].key), 2166136261U);
+			for (i = g & (tail_hash_size - 1); tail_hash[i] != -1;
+			    i = (i + 1) & (tail_hash_size - 1))
+				;
+			tail_hash[i] = j;
+		}
+	}
+	for (i = h & (tail_hash_size - 1); tail_hash[i] != -1;
+	    i = (i + 1) & (tail_hash_size - 1))
+		;
+	if (num_tails >= max_tails)
+	{
+		max_tails *= 2;
+		tails = (tail*)realloc_check((void*)tails, max_tails * sizeof(tail));
+	}
+	n = num_tails++;
+	tail_hash[i] = n;
+	(void)memcpy(tails[n].key, key, sizeof(key));
+	make_tail(n);
+	return n;
+}
+
+static void make_tail(int tail_num)
+{
+	tail* t;
+	char* hostname;
+	char* mine;
+	size_t size;
+	int bytes;
+
+	t = &tails[tail_num];
+	hostname = hosts[t->key[0]].hostname;
+	mine = t->key[1] == -1 ? "" : header_sets[t->key[1]].text;
+	size = strlen(hostname) + strlen(VERSION) + strlen(mine)
+	    + strlen(extra_headers) + 200;
+	t->text = arena_alloc(size);
+	bytes = 0;
+	/* The default headers give way to any given for the URL or by -header,
+	** and the URL's own give way to none.
+	*/
+	if (!has_header(mine, "Host", 4) && !has_header(extra_headers, "Host", 4))
+		bytes += snprintf(&t->text[bytes], size - bytes, "Host: %s\r\n",
+		    hostname);
+	if (!has_header(mine, "User-Agent", 10)
+	    && !has_header(extra_headers, "User-Agent", 10))
+		bytes += snprintf(&t->text[bytes], size - bytes, "User-Agent: %s\r\n",
+		    VERSION);
+	bytes += copy_headers(&t->text[bytes], extra_headers, mine);
+	bytes += copy_headers(&t->text[bytes], mine, (char*)0);
+	/* The body follows the headers, straight from its file. */
+	if (t->key[2] != -1)
+		bytes += snprintf(&t->text[bytes], size - bytes,
+		    "Content-Length: %lld\r\n", (long long)bodies[t->key[2]].size);
+	else if (t->key[3])
+		bytes += snprintf(&t->text[bytes], size - bytes, "Content-Length: 0\r\n");
+	t->open_len = bytes;
+	/* Tells the server when this is the last request we'll send it. */
+	bytes += snprintf(&t->text[bytes], size - bytes, "Connection: close\r\n\r\n");
+	t->len = bytes;
+}
+
+static void compile_template(int url_num)
+{
+	char* line;
+	char* end;
+	char* cp;
+	char* open;
+	char* close;
+	char* dash;
+	segment* seg;
+	int n, max;
+	unsigned long long low, high;
+
+	/* Nothing to do for a plain URL. */
+	line = urls[url_num].line;
+	end = &line[urls[url_num].line_len];
+	urls[url_num].segs = (segment*)0;
+	urls[url_num].num_segs = 0;
+	n = 1;
+	for (cp = line; cp < end; ++cp)
+		if (*cp == '{')
+			n += 2;
+	if (n == 1)
+		return;
+
+	/* Split it into text and variables, a text piece either side of each
+	** variable at most.
+	*/
+	urls[url_num].segs = (segment*)malloc_check(n * sizeof(segment));
+	seg = urls[url_num].segs;
+	max = 0;
+	for (cp = line; cp < end; cp = close + 1)
+	{
+		open = (char*)memchr(cp, '{', end - cp);
+		if (open == (char*)0)
+			open = end;
+		if (open > cp)
+		{
+			seg->type = SEG_TEXT;
+			seg->off = cp - line;
+			seg->len = open - cp;
+			max += seg->len;
+			++seg;
+		}
+		if (open == end)
+			break;
+		close = (char*)memchr(open, '}', end - open);
+		if (close == (char*)0)
+		{
+			(void)fprintf(stderr, "%s: unclosed { in %s\n", argv0,
+			    urls[url_num].url_str);
+			exit(1);
+		}
+		if (close - open == 4 && strncmp(open, "{seq", 4) == 0)
+			seg->type = SEG_SEQ;
+		else if (strncmp(open, "{rand:", 6) == 0)
+		{
+			seg->type = SEG_RAND;
+			low = high = 0;
+			dash = open + 6;
+			if (isdigit((unsigned char)*dash))
+				low = strtoull(dash, &dash, 10);
+			if (*dash == '-' && isdigit((unsigned char)dash[1]))
+				high = strtoull(dash + 1, &dash, 10);
+			else
+				dash = open;
+			if (dash != close || high < low || high - low == ~0ULL)
+			{
+				(void)fprintf(stderr, "%s: bad {rand:low-high} in %s\n",
+				    argv0, urls[url_num].url_str);
+				exit(1);
+			}
+			seg->low = low;
+			seg->range = high - low + 1;
+		}
+		else
+		{
+			(void)fprintf(stderr, "%s: unknown variable %.*s in %s\n", argv0,
+			    (int)(close + 1 - open), open, urls[url_num].url_str);
+			exit(1);
+		}
+		max += 20;	/* digits in the biggest unsigned long long */
+		++seg;
+	}
+	urls[url_num].num_segs = seg - urls[url_num].segs;
+	if (max > render_max)
+		render_max = max;
+}
+
+static void render_request(int cnum, int slot, int url_num)
+{
+	segment* seg;
+	segment* end;
+	char* buf;
+	char* cp;
+	unsigned long long n;
+
+	/* Fill in the request line for a templated URL, in the connection's
+	** own buffer.  Slot 0 is the request being read, the pipe's places
+	** follow.
+	*/
+	if (urls[url_num].num_segs == 0)
+		return;
+	buf = cp = &connections_cold[cnum].render[slot * render_max];
+	end = urls[url_num].segs + urls[url_num].num_segs;
+	for (seg = urls[url_num].segs; seg < end; ++seg)
+	{
+		switch (seg->type)
+		{
+		case SEG_TEXT:
+			(void)memcpy(cp, &urls[url_num].line[seg->off], seg->len);
+			cp += seg->len;
+			break;
+		case SEG_SEQ:
+			n = seq_next;
+			seq_next += num_workers;
+			cp += put_number(cp, n);
+			break;
+		case SEG_RAND:
+			n = seg->low + (unsigned long long)(((unsigned __int128)fast_random()
+			    * seg->range) >> 64);
+			cp += put_number(cp, n);
+			break;
+		}
+	}
+	if (slot == 0)
+		connections_cold[cnum].render_len = cp - buf;
+	else
+		connections_cold[cnum].pipe[slot - 1].render_len = cp - buf;
+}
+
+static int put_number(char* buf, unsigned long long n)
+{
+	char digits[20];
+	int len, i;
+
+	/* Backwards into digits, then forwards into buf. */
+	len = 0;
+	do
+	{
+		digits[len++] = '0' + n % 10;
+		n /= 10;
+	} while (n != 0);
+	for (i = 0; i < len; ++i)
+		buf[i] = digits[len - 1 - i];
+	return len;
+}
+
+static void read_sip_file(char* sip_file)
+{
+	FILE* fp;
+	char line[5000];
+
+	fp = fopen(sip_file, "r");
+	if (fp == (FILE*)0)
+	{
+		perror(sip_file);
+		exit(1);
+	}
+
+	max_sips = 100;
+	sips = (sip*)malloc_check(max_sips * sizeof(sip));
+	num_sips = 0;
+	while (fgets(line, sizeof(line), fp) != (char*)0)
+	{
+		/* Nuke trailing newline. */
+		if (line[strlen(line) - 1] == '\n')
+			line[strlen(line) - 1] = '\0';
+
+		/* Check for room in sips. */
+		if (num_sips >= max_sips)
+		{
+			max_sips *= 2;
+			sips = (sip*)realloc_check((void*)sips, max_sips * sizeof(sip));
+		}
+
+		/* Add to table. */
+		sips[num_sips].str = strdup_check(line);
+		(void)memset((void*)&sips[num_sips].sa, 0, sizeof(sips[num_sips].sa));
+		if (!inet_aton(sips[num_sips].str, &sips[num_sips].sa.sin_addr))
+		{
+			(void)fprintf(stderr, "%s: cannot convert source IP address %s\n",
+			    argv0, sips[num_sips].str);
+			exit(1);
+		}
+		++num_sips;
+	}
+}
+
+static int start_connection(int url_num, long long scheduled_at,
+    long long* nowP)
+{
+	int cnum;
+
+	/* With -parallel, open all the connections before piling requests
+	** on them.
+	*/
+	if (pipeline_depth > 1
+	    && (start != START_PARALLEL || num_open >= max_connections))
+	{
+		/* Queue it behind the requests on a busy connection to that host,
+		** preferably the one that just finished a response.
+		*/
+		cnum = room_head[hosts[urls[url_num].host].pool];
+		if (cnum != -1)
+		{
+			count_parallel(1);
+			SHARED_ADD(st->fetches_started, 1);
+			render_request(cnum, 1 + (connections_cold[cnum].pipe_first
+			    + connections[cnum].pipe_count) % (pipeline_depth - 1), url_num);
+			pipeline_request(cnum, url_num, scheduled_at, nowP);
+			return 0;
+		}
+	}
+
+	/* If we're holding a connection open to that host, use it. */
+	cnum = host_idle_head[hosts[urls[url_num].host].pool];
+	if (cnum != -1)
+	{
+		/* Take it off the idle list and send the next request. */
+		unpark_connection(cnum);
+		connections_cold[cnum].did_connect = 0;
+		start_fetch(url_num, cnum, nowP);
+		render_request(cnum, 0, url_num);
+		connections_cold[cnum].scheduled_at = scheduled_at;
+		++connections[cnum].num_requests;
+		tmr_reset(nowP, connections[cnum].idle_timer);
+		count_parallel(1);
+		SHARED_ADD(st->fetches_started, 1);
+		send_request(cnum, nowP);
+		update_room(cnum, 0);
+		return 0;
+	}
+
+	/* Find an empty connection slot.  If there are none, give up the
+	** idle connection, to some other host, that has waited longest.
+	*/
+	if (free_head == -1 && idle_tail != -1)
+		drop_connection(idle_tail);
+	cnum = take_slot();
+	if (cnum != -1)
+	{
+		/* Start the socket. */
+		render_request(cnum, 0, url_num);
+		start_socket(url_num, cnum, scheduled_at, nowP);
+		if (connections[cnum].conn_state != CNST_FREE)
+			count_parallel(1);
+		else
+			free_url(url_num);
+		SHARED_ADD(st->fetches_started, 1);
+		return 0;
+	}
+	/* No slots left, or every connection is busy with a full pipeline. */
+	return -1;
 }
 
 static int pick_url()
 {
-//	return ((unsigned long)random()) % ((unsigned int)num_urls);
-	unsigned long turn = ((unsigned long)random()) % ((unsigned int)wtotal);
-	int i = 0;
-	for ( ; i < num_urls; ++i)
+	unsigned long long turn;
+	int i;
+
+	/* One draw picks both the column and how far down it we landed. */
+	turn = (unsigned long long)(((unsigned __int128)fast_random()
+	    * ((unsigned long long)num_urls * wtotal)) >> 64);
+	i = (int)(turn / wtotal);
+	if (turn % wtotal < urls_odds[i])
+		return i;
+	return urls_alias[i];
+}
+
+static int next_replay_url(void)
+{
+	char* cp;
+	char* nl;
+	char* stamp;
+	int url_num, i;
+	size_t len;
+
+	while (replay_next < replay_end)
 	{
-		if (turn < urls_turn[i])
+		/* Take this line, and step over the other workers' ones. */
+		cp = replay_next;
+		nl = (char*)memchr(cp, '\n', replay_end - cp);
+		if (nl == (char*)0)
+			nl = replay_end;
+		replay_next = nl;
+		for (i = 1; i < num_workers && replay_next < replay_end; ++i)
+		{
+			replay_next = (char*)memchr(replay_next + 1, '\n',
+			    replay_end - replay_next - 1);
+			if (replay_next == (char*)0)
+				replay_next = replay_end;
+		}
+		if (replay_next < replay_end)
+			++replay_next;
+		/* The header sets were all made before the run. */
+		if (*cp == '@')
+			continue;
+
+		/* Copy the line into the slot, after its request line buffer,
+		** for the URL's fields to point into.
+		*/
+		url_num = take_url();
+		len = nl - cp;
+		(void)memcpy(&urls[url_num].line[replay_line_max], cp, len);
+		urls[url_num].line[replay_line_max + len] = '\0';
+		stamp = parse_url_line(&urls[url_num].line[replay_line_max], url_num);
+		if (stamp == (char*)0)
 		{
-			return i;
+			free_url(url_num);
+			continue;
 		}
+		replay_at = start_at + (long long)((strtod(stamp, (char**)0)
+		    - replay_first) * 1000000000.0 / replay_speed);
+		return url_num;
 	}
-	printf("error: wrong turn of url weight\n");
-	exit(1);
+	return -1;
 }
 
-static void start_socket(int url_num, int cnum, struct timeval* nowP)
+static int take_url(void)
 {
-	ClientData client_data;
-	int flags;
-	int sip_num;
+	int url_num;
 
-	/* Start filling in the connection slot. */
+	if (num_free_urls > 0)
+		return free_urls[--num_free_urls];
+	if (num_url_slots >= max_url_slots)
+	{
+		max_url_slots = max_url_slots == 0 ? 64 : max_url_slots * 2;
+		urls = (url*)realloc_check((void*)urls, max_url_slots * sizeof(url));
+		free_urls = (int*)realloc_check((void*)free_urls,
+		    max_url_slots * sizeof(int));
+	}
+	url_num = num_url_slots++;
+	/* Room for its request line, and then its line from the log. */
+	urls[url_num].line = (char*)malloc_check(replay_line_max + replay_text_max);
+	urls[url_num].segs = (segment*)0;
+	return url_num;
+}
+
+static void free_url(int url_num)
+{
+	/* Only replay slots get reused. */
+	if (start == START_REPLAY)
+		free_urls[num_free_urls++] = url_num;
+}
+
+static unsigned long long fast_random(void)
+{
+	unsigned long long x = rng_state;
+
+	/* xorshift64*: a few shifts and a multiply, and no lock. */
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	rng_state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static address* pick_address(int set_num)
+{
+	address_list* list;
+	int n;
+
+	list = __atomic_load_n(&address_sets[set_num].list, __ATOMIC_ACQUIRE);
+	n = list->num_addrs;
+	if (n == 1 || rotate == ROTATE_NONE)
+		return &list->addrs[0];
+	if (rotate == ROTATE_RANDOM)
+		return &list->addrs[fast_random() % (unsigned int)n];
+	return &list->addrs[address_turn[set_num]++ % (unsigned int)n];
+}
+
+static void start_fetch(int url_num, int cnum, long long* nowP)
+{
+	/* Reset the per-fetch parts of the connection slot. */
 	connections[cnum].url_num = url_num;
-	connections[cnum].started_at = *nowP;
-	client_data.i = cnum;
-	connections[cnum].did_connect = 0;
+	connections_cold[cnum].scheduled_at = *nowP;
+	connections_cold[cnum].started_at = *nowP;
 	connections[cnum].did_response = 0;
-	connections[cnum].idle_timer = tmr_create(nowP, idle_connection,
-	    client_data, idle_secs * 1000L, 0);
-	connections[cnum].wakeup_timer = (Timer*)0;
+	connections_cold[cnum].wakeup_timer = (Timer*)0;
 	connections[cnum].content_length = -1;
+	connections[cnum].chunked = 0;
 	connections[cnum].bytes = 0;
 	connections[cnum].checksum = 0;
 	connections[cnum].http_status = -1;
+	connections[cnum].keep_alive = 0;
+	connections[cnum].head = strcmp(urls[url_num].method, "HEAD") == 0;
+}
+
+static void start_socket(int url_num, int cnum, long long scheduled_at,
+    long long* nowP)
+{
+	ClientData client_data;
+	int flags, r;
+	int sip_num;
+	address* a;
+	unsigned short port;
 
-	/* Make a socket. */
-	connections[cnum].conn_fd = socket(urls[url_num].sock_family,
-	    urls[url_num].sock_type, urls[url_num].sock_protocol);
+	/* Start filling in the connection slot. */
+	start_fetch(url_num, cnum, nowP);
+	connections_cold[cnum].scheduled_at = scheduled_at;
+	connections_cold[cnum].did_connect = 0;
+	/* Anything already queued behind it gets sent again along with it. */
+	connections[cnum].num_requests = 1 + connections[cnum].pipe_count;
+#ifdef USE_SSL
+	connections_cold[cnum].ssl = (SSL*) 0;
+	connections_cold[cnum].early = 0;
+#endif
+
+	/* Make a socket, for whichever of the host's addresses is next. */
+	a = pick_address(hosts[urls[url_num].host].addresses);
+	connections[cnum].conn_fd = socket(a->sock_family, a->sock_type,
+	    a->sock_protocol);
 	if (connections[cnum].conn_fd < 0)
 	{
 		perror(urls[url_num].url_str);
+		free_slot(cnum);
 		return;
 	}
 
@@ -898,59 +2784,86 @@ static void start_socket(int url_num, int cnum, struct timeval* nowP)
 	{
 		perror(urls[url_num].url_str);
 		(void)close(connections[cnum].conn_fd);
+		free_slot(cnum);
 		return;
 	}
 	if (fcntl(connections[cnum].conn_fd, F_SETFL, flags | O_NDELAY) < 0)
 	{
 		perror(urls[url_num].url_str);
 		(void)close(connections[cnum].conn_fd);
+		free_slot(cnum);
 		return;
 	}
 
 	if (num_sips > 0)
 	{
 		/* Try a random source IP address. */
-		sip_num = ((unsigned long)random()) % ((unsigned int)num_sips);
+		sip_num = fast_random() % (unsigned int)num_sips;
 		if (bind(connections[cnum].conn_fd, (struct sockaddr*)&sips[sip_num].sa,
 		    sizeof(sips[sip_num].sa)) < 0)
 		{
 			perror("binding local address");
 			(void)close(connections[cnum].conn_fd);
+			free_slot(cnum);
 			return;
 		}
 	}
 
-	/* Connect to the host. */
-	connections[cnum].sa_len = urls[url_num].sa_len;
-	(void)memmove((void*)&connections[cnum].sa, (void*)&urls[url_num].sa,
-	    urls[url_num].sa_len);
-	connections[cnum].connect_at = *nowP;
-	if (connect(connections[cnum].conn_fd,
-	    (struct sockaddr*)&connections[cnum].sa, connections[cnum].sa_len) < 0)
+	/* Watch it from now until it gets closed. */
+	if (fdwatch_add_fd(connections[cnum].conn_fd, cnum, FDW_WRITE) < 0)
 	{
-		if (errno == EINPROGRESS)
-		{
-			connections[cnum].conn_state = CNST_CONNECTING;
-			return;
-		}
-		else
-		{
-			perror(urls[url_num].url_str);
-			(void)close(connections[cnum].conn_fd);
-			return;
-		}
+		perror(urls[url_num].url_str);
+		(void)close(connections[cnum].conn_fd);
+		free_slot(cnum);
+		return;
+	}
+
+	/* Connect to the host.  The connection remembers which, since its
+	** URL may be gone by the time it's reused.
+	*/
+	connections_cold[cnum].host = urls[url_num].host;
+	connections_cold[cnum].sa_len = a->sa_len;
+	(void)memmove((void*)&connections_cold[cnum].sa, (void*)&a->sa, a->sa_len);
+	port = htons(do_proxy ? proxy_port : hosts[urls[url_num].host].port);
+#ifdef USE_IPV6
+	if (a->sock_family == AF_INET6)
+		connections_cold[cnum].sa.sin6_port = port;
+	else
+		((struct sockaddr_in*)&connections_cold[cnum].sa)->sin_port = port;
+#else /* USE_IPV6 */
+	connections_cold[cnum].sa.sin_port = port;
+#endif /* USE_IPV6 */
+	connections_cold[cnum].connect_at = *nowP;
+	r = connect(connections[cnum].conn_fd,
+	    (struct sockaddr*)&connections_cold[cnum].sa, connections_cold[cnum].sa_len);
+	if (r < 0 && errno != EINPROGRESS)
+	{
+		perror(urls[url_num].url_str);
+		fdwatch_del_fd(connections[cnum].conn_fd);
+		(void)close(connections[cnum].conn_fd);
+		free_slot(cnum);
+		return;
+	}
+	client_data.i = cnum;
+	connections[cnum].idle_timer = tmr_create(nowP, idle_connection,
+	    client_data, idle_secs * 1000L, 0);
+	++num_open;
+	if (r < 0)
+	{
+		connections[cnum].conn_state = CNST_CONNECTING;
+		update_room(cnum, 0);
+		return;
 	}
 
 	/* Connect succeeded instantly, so handle it now. */
-	(void)gettimeofday(nowP, (struct timezone*)0);
+	*nowP = tmr_now();
 	handle_connect(cnum, nowP, 0);
+	update_room(cnum, 0);
 }
 
-static void handle_connect(int cnum, struct timeval* nowP, int double_check)
+static void handle_connect(int cnum, long long* nowP, int double_check)
 {
 	int url_num;
-	char buf[600];
-	int bytes, r;
 
 	url_num = connections[cnum].url_num;
 	if (double_check)
@@ -959,7 +2872,7 @@ static void handle_connect(int cnum, struct timeval* nowP, int double_check)
 		int err, errlen;
 
 		if (connect(connections[cnum].conn_fd,
-		    (struct sockaddr*)&connections[cnum].sa, connections[cnum].sa_len)
+		    (struct sockaddr*)&connections_cold[cnum].sa, connections_cold[cnum].sa_len)
 		    < 0)
 		{
 			switch(errno)
@@ -977,167 +2890,1223 @@ static void handle_connect(int cnum, struct timeval* nowP, int double_check)
 					{
 						(void) fprintf(stderr, "%s: %s\n", urls[url_num].url_str, strerror( err ));
 					}
-					close_connection( cnum );
+					close_connection( cnum, nowP );
 				return;
 				default:
 					perror( urls[url_num].url_str );
-					close_connection( cnum );
+					close_connection( cnum, nowP );
 				return;
 			}
 		}
 	}
+	connections_cold[cnum].handshake_at = *nowP;
 #ifdef USE_SSL
-	if ( urls[url_num].protocol == PROTO_HTTPS )
+	if ( hosts[urls[url_num].host].protocol == PROTO_HTTPS )
 	{
-		int flags;
-
-		/* Make SSL connection. */
-		if ( ssl_ctx == (SSL_CTX*) 0 )
+		/* The handshake goes a step at a time, whenever the socket is
+		** ready, like everything else.
+		*/
+		SSL* ssl;
+		SSL_SESSION* session;
+		char* hostname;
+		struct in6_addr ia;
+		long size;
+		int n;
+
+		ssl = connections_cold[cnum].ssl = SSL_new( ssl_ctx );
+		SSL_set_fd( ssl, connections[cnum].conn_fd );
+		SSL_set_app_data( ssl, (char*) &connections_cold[cnum] );
+		/* Name the host for virtual hosting, unless it's an address. */
+		hostname = hosts[connections_cold[cnum].host].hostname;
+		if ( inet_pton( AF_INET, hostname, (void*) &ia ) != 1
+		    && inet_pton( AF_INET6, hostname, (void*) &ia ) != 1 )
+			SSL_set_tlsext_host_name( ssl, hostname );
+		session = sessions == (SSL_SESSION**) 0
+		    ? (SSL_SESSION*) 0 : sessions[connections_cold[cnum].host];
+		if ( session != (SSL_SESSION*) 0 && ! SSL_SESSION_is_resumable( session ) )
 		{
-			SSL_load_error_strings();
-			SSLeay_add_ssl_algorithms();
-			ssl_ctx = SSL_CTX_new( SSLv23_client_method() );
-			if ( cipher != (char*) 0 )
-			{
-				if ( ! SSL_CTX_set_cipher_list( ssl_ctx, cipher ) )
-				{
-					(void) fprintf(
-						stderr, "%s: cannot set cipher list\n", argv0 );
-					ERR_print_errors_fp( stderr );
-					close_connection( cnum );
-					return;
-				}
-			}
+			/* A connection that failed with it spoiled it. */
+			SSL_SESSION_free( session );
+			session = sessions[connections_cold[cnum].host] = (SSL_SESSION*) 0;
 		}
-		if ( ! RAND_status() )
+		if ( session != (SSL_SESSION*) 0 )
+			SSL_set_session( ssl, session );
+		/* With a session that allows it, a first request that's safe to
+		** replay can go in the first flight.
+		*/
+		if ( do_early_data && session != (SSL_SESSION*) 0
+		    && urls[url_num].body == -1
+		    && ( strcmp( urls[url_num].method, "GET" ) == 0
+		         || strcmp( urls[url_num].method, "HEAD" ) == 0 ) )
 		{
-			unsigned char bytes[1024];
-			int i;
-			for ( i = 0; i < sizeof(bytes); ++i )
-			bytes[i] = random() % 0xff;
-			RAND_seed( bytes, sizeof(bytes) );
+			n = connections[cnum].num_requests - connections[cnum].pipe_count;
+			size = header_size( cnum, 0, keepalive_max > 0 && n >= keepalive_max );
+			if ( size <= EARLY_DATA_MAX
+			    && size <= SSL_SESSION_get_max_early_data( session ) )
+			{
+				connections_cold[cnum].early = 1;
+				connections_cold[cnum].request_at = *nowP;
+			}
 		}
-		flags = fcntl( connections[cnum].conn_fd, F_GETFL, 0 );
-		if ( flags != -1 )
-		(void) fcntl(
-			connections[cnum].conn_fd, F_SETFL, flags & ~ (int) O_NDELAY );
-		connections[cnum].ssl = SSL_new( ssl_ctx );
-		SSL_set_fd( connections[cnum].ssl, connections[cnum].conn_fd );
-		r = SSL_connect( connections[cnum].ssl );
-		if ( r <= 0 )
+		connections[cnum].conn_state = CNST_HANDSHAKE;
+		handle_handshake( cnum, nowP );
+		return;
+	}
+#endif
+	connections_cold[cnum].did_connect = 1;
+	send_request(cnum, nowP);
+}
+
+#ifdef USE_SSL
+static void handle_handshake( int cnum, long long* nowP )
+{
+	SSL* ssl;
+	const unsigned char* proto;
+	unsigned int proto_len;
+	int i, r;
+
+	ssl = connections_cold[cnum].ssl;
+	r = connections_cold[cnum].early == 1 ? write_early_data( cnum ) : 1;
+	if ( r > 0 )
+		r = SSL_connect( ssl );
+	if ( r <= 0 )
+	{
+		/* Not done yet, wait for the socket to be ready for the next step. */
+		switch ( SSL_get_error( ssl, r ) )
 		{
-			(void) fprintf(
-				stderr, "%s: SSL connection failed - %d\n", argv0, r );
-			ERR_print_errors_fp( stderr );
-			close_connection( cnum );
+			case SSL_ERROR_WANT_READ:
+			fdwatch_mod_fd( connections[cnum].conn_fd, FDW_READ );
+			return;
+			case SSL_ERROR_WANT_WRITE:
+			fdwatch_mod_fd( connections[cnum].conn_fd, FDW_WRITE );
 			return;
 		}
+		(void) fprintf(
+			stderr, "%s: SSL connection failed - %d\n", argv0, r );
+		ERR_print_errors_fp( stderr );
+		close_connection( cnum, nowP );
+		return;
 	}
-#endif
-	connections[cnum].did_connect = 1;
-
-	/* Format the request. */
-	if (do_proxy)
+	/* The last step can be a lot of crypto, so the clock has moved on. */
+	*nowP = tmr_now();
+	hist_record( &st->handshake_hist, *nowP - connections_cold[cnum].handshake_at );
+	if ( SSL_session_reused( ssl ) )
+		++st->handshakes_resumed;
+	if ( alpn != (unsigned char*) 0 )
 	{
-#ifdef USE_SSL
-		bytes = snprintf(
-			buf, sizeof(buf), "GET %s://%.500s:%d%.500s HTTP/1.0\r\n",
-			urls[url_num].protocol == PROTO_HTTPS ? "https" : "http",
-			urls[url_num].hostname, (int) urls[url_num].port,
-			urls[url_num].filename );
-#else
-		bytes = snprintf(buf, sizeof(buf),
-		    "GET http://%.500s:%d%.500s HTTP/1.0\r\n", urls[url_num].hostname,
-		    (int)urls[url_num].port, urls[url_num].filename);
-#endif
+		SSL_get0_alpn_selected( ssl, &proto, &proto_len );
+		if ( proto_len > 0 )
+			++st->alpn_agreed;
 	}
-	else
+	connections_cold[cnum].did_connect = 1;
+	if ( connections_cold[cnum].early )
 	{
-		bytes = snprintf(buf, sizeof(buf), "GET %.500s HTTP/1.0\r\n",
-		    urls[url_num].filename);
+		connections_cold[cnum].early = 0;
+		if ( SSL_get_early_data_status( ssl ) == SSL_EARLY_DATA_ACCEPTED )
+		{
+			/* The first request is out already, just the rest to go. */
+			++st->early_accepted;
+			for ( i = 0; i < connections[cnum].pipe_count; ++i )
+				connections_cold[cnum].pipe[( connections_cold[cnum].pipe_first + i )
+				    % ( pipeline_depth - 1 )].request_at = *nowP;
+			connections[cnum].unsent = connections[cnum].pipe_count;
+			connections_cold[cnum].send_off = 0;
+			connections[cnum].conn_state = CNST_WRITING;
+			handle_write( cnum, nowP );
+			return;
+		}
+		/* Turned down, so it goes again the usual way. */
+		++st->early_rejected;
 	}
-	bytes += snprintf(&buf[bytes], sizeof(buf) - bytes, "Host: %s\r\n",
-	    urls[url_num].hostname);
-	bytes += snprintf(&buf[bytes], sizeof(buf) - bytes, "User-Agent: %s\r\n",
-	    VERSION);
-	bytes += snprintf(&buf[bytes], sizeof(buf) - bytes, "\r\n");
-
-	/* Send the request. */
-	connections[cnum].request_at = *nowP;
-#ifdef USE_SSL
-	if ( urls[url_num].protocol == PROTO_HTTPS )
-	r = SSL_write( connections[cnum].ssl, buf, bytes );
-	else
-	r = write( connections[cnum].conn_fd, buf, bytes );
-#else
-	r = write(connections[cnum].conn_fd, buf, bytes);
-#endif
+	send_request( cnum, nowP );
+}
 
-	if (r < 0)
+static int write_early_data( int cnum )
+{
+	char buf[EARLY_DATA_MAX];
+	struct iovec iov[3];
+	int iovcnt, i, n;
+	size_t len, written;
+
+	/* All in one record, so it goes in one packet. */
+	n = connections[cnum].num_requests - connections[cnum].pipe_count;
+	iovcnt = add_request( iov, cnum, 0, keepalive_max > 0 && n >= keepalive_max );
+	len = 0;
+	for ( i = 0; i < iovcnt; ++i )
 	{
-		perror(urls[url_num].url_str);
-		close_connection(cnum);
-		return;
+		(void) memcpy( &buf[len], iov[i].iov_base, iov[i].iov_len );
+		len += iov[i].iov_len;
 	}
-	connections[cnum].conn_state = CNST_HEADERS;
-	connections[cnum].header_state = HDST_LINE1_PROTOCOL;
+	if ( ! SSL_write_early_data( connections_cold[cnum].ssl, buf, len, &written ) )
+		return 0;
+	st->total_sent_bytes += written;
+	connections_cold[cnum].early = 2;
+	return 1;
 }
 
-static void handle_read(int cnum, struct timeval* nowP)
+static int new_session( SSL* ssl, SSL_SESSION* session )
 {
-	char buf[30000]; /* must be larger than throttle / 2 */
-	int bytes_to_read, bytes_read, bytes_handled;
-	float elapsed;
-	ClientData client_data;
+	connection_cold* c;
+
+	/* Keep the newest, the next connection to the host offers it. */
+	c = (connection_cold*) SSL_get_app_data( ssl );
+	if ( sessions[c->host] != (SSL_SESSION*) 0 )
+		SSL_SESSION_free( sessions[c->host] );
+	sessions[c->host] = session;
+	return 1;
+}
+
+static void ssl_failed( char* what )
+{
+	(void) fprintf( stderr, "%s: cannot set %s\n", argv0, what );
+	ERR_print_errors_fp( stderr );
+	exit( 1 );
+}
+#endif /* USE_SSL */
+
+static int pipeline_room(int cnum)
+{
+	/* Can another request go down this connection? */
+	switch (connections[cnum].conn_state)
+	{
+	case CNST_CONNECTING:
+	case CNST_HANDSHAKE:
+	case CNST_WRITING:
+	case CNST_HEADERS:
+	case CNST_READING:
+	case CNST_PAUSING:
+		break;
+	default:
+		return 0;
+	}
+	if (connections[cnum].pipe_count >= pipeline_depth - 1)
+		return 0;
+	if (keepalive_max > 0 && connections[cnum].num_requests >= keepalive_max)
+		return 0;
+	return 1;
+}
+
+static void update_room(int cnum, int to_front)
+{
+	int* head;
+
+	/* Put the connection on its host's list of pipelines with room, or
+	** take it off, to match.  One that just made room goes to the front,
+	** so its pipeline gets filled first.
+	*/
+	if (connections_cold[cnum].on_room_list
+	    && (to_front || !pipeline_room(cnum)))
+	{
+		head = &room_head[hosts[connections_cold[cnum].host].pool];
+		if (connections_cold[cnum].prev_room != -1)
+			connections_cold[connections_cold[cnum].prev_room].next_room =
+			    connections_cold[cnum].next_room;
+		else
+			*head = connections_cold[cnum].next_room;
+		if (connections_cold[cnum].next_room != -1)
+			connections_cold[connections_cold[cnum].next_room].prev_room =
+			    connections_cold[cnum].prev_room;
+		connections_cold[cnum].on_room_list = 0;
+	}
+	if (!connections_cold[cnum].on_room_list && pipeline_room(cnum))
+	{
+		head = &room_head[hosts[connections_cold[cnum].host].pool];
+		connections_cold[cnum].prev_room = -1;
+		connections_cold[cnum].next_room = *head;
+		if (*head != -1)
+			connections_cold[*head].prev_room = cnum;
+		*head = cnum;
+		connections_cold[cnum].on_room_list = 1;
+		slot_opened();
+	}
+}
+
+static void pipeline_request(int cnum, int url_num, long long scheduled_at,
+    long long* nowP)
+{
+	pipelined* p;
+
+	/* Add it to the end of the queue. */
+	p = &connections_cold[cnum].pipe[(connections_cold[cnum].pipe_first
+	    + connections[cnum].pipe_count) % (pipeline_depth - 1)];
+	p->url_num = url_num;
+	p->scheduled_at = scheduled_at;
+	p->request_at = *nowP;
+	++connections[cnum].pipe_count;
+	++connections[cnum].num_requests;
+	update_room(cnum, 0);
+
+	/* Still connecting, it goes out with the first request.  If earlier
+	** requests are waiting for room to write, it goes out after them.
+	** Otherwise send it now.
+	*/
+	if (connections[cnum].conn_state == CNST_CONNECTING
+	    || connections[cnum].conn_state == CNST_HANDSHAKE)
+		return;
+	++connections[cnum].unsent;
+	if (connections[cnum].unsent == 1)
+		handle_write(cnum, nowP);
+}
+
+static void next_request(int cnum, long long* nowP)
+{
+	pipelined* p;
+
+	/* Move on to the response for the oldest queued request. */
+	p = &connections_cold[cnum].pipe[connections_cold[cnum].pipe_first];
+	connections_cold[cnum].pipe_first =
+	    (connections_cold[cnum].pipe_first + 1) % (pipeline_depth - 1);
+	--connections[cnum].pipe_count;
+	if (connections_cold[cnum].wakeup_timer != (Timer*)0)
+		tmr_cancel(connections_cold[cnum].wakeup_timer);
+	start_fetch(p->url_num, cnum, nowP);
+	if (urls[p->url_num].num_segs > 0)
+	{
+		(void)memcpy(connections_cold[cnum].render,
+		    &connections_cold[cnum].render[(p - connections_cold[cnum].pipe + 1)
+		    * render_max], p->render_len);
+		connections_cold[cnum].render_len = p->render_len;
+	}
+	connections_cold[cnum].scheduled_at = p->scheduled_at;
+	connections_cold[cnum].request_at = p->request_at;
+	connections_cold[cnum].did_connect = 0;
+	connections[cnum].conn_state = CNST_HEADERS;
+	connections[cnum].header_state = HDST_LINE1_PROTOCOL;
+	update_room(cnum, 1);
+}
+
+static int queued_url(int cnum, int i)
+{
+	/* The URL of a request on a connection: 0 is the one whose response
+	** is being read, the ones behind it count up from 1.
+	*/
+	if (i == 0)
+		return connections[cnum].url_num;
+	return connections_cold[cnum].pipe[(connections_cold[cnum].pipe_first
+	    + i - 1) % (pipeline_depth - 1)].url_num;
+}
+
+static int add_request(struct iovec* iov, int cnum, int i, int last)
+{
+	int url_num, n, slot;
+
+	/* Point at the URL's request line, or the one rendered for this
+	** request, and then its headers with or without the Connection: close.
+	*/
+	url_num = queued_url(cnum, i);
+	n = 0;
+	if (urls[url_num].num_segs > 0)
+	{
+		if (i == 0)
+		{
+			iov[n].iov_base = (void*)connections_cold[cnum].render;
+			iov[n++].iov_len = connections_cold[cnum].render_len;
+		}
+		else
+		{
+			slot = (connections_cold[cnum].pipe_first + i - 1)
+			    % (pipeline_depth - 1);
+			iov[n].iov_base = (void*)&connections_cold[cnum].render[(slot + 1)
+			    * render_max];
+			iov[n++].iov_len = connections_cold[cnum].pipe[slot].render_len;
+		}
+	}
+	else
+	{
+		iov[n].iov_base = (void*)urls[url_num].line;
+		iov[n++].iov_len = urls[url_num].line_len;
+	}
+	iov[n].iov_base = (void*)tails[urls[url_num].tail].text;
+	if (last)
+	{
+		iov[n++].iov_len = tails[urls[url_num].tail].len;
+		return n;
+	}
+	iov[n++].iov_len = tails[urls[url_num].tail].open_len;
+	iov[n].iov_base = (void*)"\r\n";
+	iov[n++].iov_len = 2;
+	return n;
+}
+
+static void send_request(int cnum, long long* nowP)
+{
+	int i;
+
+	/* The request, and any queued up behind it, all go out together. */
+	connections_cold[cnum].request_at = *nowP;
+	for (i = 0; i < connections[cnum].pipe_count; ++i)
+		connections_cold[cnum].pipe[(connections_cold[cnum].pipe_first + i)
+		    % (pipeline_depth - 1)].request_at = *nowP;
+	connections[cnum].unsent = 1 + connections[cnum].pipe_count;
+	connections_cold[cnum].send_off = 0;
+	connections[cnum].conn_state = CNST_WRITING;
+	handle_write(cnum, nowP);
+}
+
+static long header_size(int cnum, int i, int last)
+{
+	int url_num;
+	long size;
+
+	url_num = queued_url(cnum, i);
+	size = last ? tails[urls[url_num].tail].len
+	    : tails[urls[url_num].tail].open_len + 2;
+	if (urls[url_num].num_segs == 0)
+		size += urls[url_num].line_len;
+	else if (i == 0)
+		size += connections_cold[cnum].render_len;
+	else
+		size += connections_cold[cnum].pipe[(connections_cold[cnum].pipe_first
+		    + i - 1) % (pipeline_depth - 1)].render_len;
+	return size;
+}
+
+static long request_size(int cnum, int i, int last)
+{
+	int url_num;
+	long size;
+
+	url_num = queued_url(cnum, i);
+	size = header_size(cnum, i, last);
+	if (urls[url_num].body != -1)
+		size += bodies[urls[url_num].body].size;
+	return size;
+}
+
+static void request_sent(int cnum, int i, long long* nowP)
+{
+	long long request_at;
+
+	/* The last byte of a body is out, time the upload. */
+	if (urls[queued_url(cnum, i)].body == -1)
+		return;
+	if (i == 0)
+		request_at = connections_cold[cnum].request_at;
+	else
+		request_at = connections_cold[cnum].pipe[(connections_cold[cnum].pipe_first
+		    + i - 1) % (pipeline_depth - 1)].request_at;
+	hist_record(&st->upload_hist, *nowP - request_at);
+}
+
+static void handle_write(int cnum, long long* nowP)
+{
+	struct iovec iov[3 * MAX_PIPELINE];
+	struct iovec* v;
+	int iovcnt, n, first, i, url_num, last;
+	long skip, header_len, size;
+	off_t body_off;
+	ssize_t r;
+
+	n = connections[cnum].num_requests - connections[cnum].pipe_count;
+	while (connections[cnum].unsent > 0)
+	{
+		first = 1 + connections[cnum].pipe_count - connections[cnum].unsent;
+		url_num = queued_url(cnum, first);
+		last = keepalive_max > 0 && n + first >= keepalive_max;
+		header_len = header_size(cnum, first, last);
+		if (connections_cold[cnum].send_off >= header_len)
+		{
+			/* Partway through a body, it goes straight from the file. */
+			body_off = connections_cold[cnum].send_off - header_len;
+#ifdef USE_SSL
+			if ( connections_cold[cnum].ssl != (SSL*) 0 )
+			{
+				r = bodies[urls[url_num].body].size - body_off;
+				if ( r > 65536 )
+					r = 65536;
+				r = SSL_write( connections_cold[cnum].ssl,
+				    &bodies[urls[url_num].body].map[body_off], r );
+				if ( r <= 0 )
+				{
+					errno = SSL_get_error( connections_cold[cnum].ssl, r )
+					    == SSL_ERROR_WANT_WRITE ? EAGAIN : EIO;
+					r = -1;
+				}
+			}
+			else
+#endif
+			r = sendfile(connections[cnum].conn_fd,
+			    bodies[urls[url_num].body].fd, &body_off,
+			    bodies[urls[url_num].body].size - body_off);
+		}
+		else
+		{
+			/* Gather the unsent request headers, up to and including
+			** the next one with a body, leaving out what already went.
+			*/
+			iovcnt = 0;
+			for (i = first; i <= connections[cnum].pipe_count; ++i)
+			{
+				iovcnt += add_request(&iov[iovcnt], cnum, i,
+				    keepalive_max > 0 && n + i >= keepalive_max);
+				if (urls[queued_url(cnum, i)].body != -1)
+					break;
+			}
+			v = iov;
+			for (skip = connections_cold[cnum].send_off; skip >= v->iov_len;
+			    ++v, --iovcnt)
+				skip -= v->iov_len;
+			v->iov_base = (char*)v->iov_base + skip;
+			v->iov_len -= skip;
+#ifdef USE_SSL
+			if ( connections_cold[cnum].ssl != (SSL*) 0 )
+			{
+				r = SSL_write( connections_cold[cnum].ssl, v->iov_base,
+				    v->iov_len );
+				if ( r <= 0 )
+				{
+					errno = SSL_get_error( connections_cold[cnum].ssl, r )
+					    == SSL_ERROR_WANT_WRITE ? EAGAIN : EIO;
+					r = -1;
+				}
+			}
+			else
+#endif
+			r = writev(connections[cnum].conn_fd, v, iovcnt);
+		}
+		if (r == 0 && connections_cold[cnum].send_off >= header_len)
+		{
+			/* The body file got shorter since we opened it, and the
+			** rest of the body will never come.
+			*/
+			(void)fprintf(stderr, "%s: %s is shorter than it was\n",
+			    urls[url_num].url_str,
+			    bodies[urls[url_num].body].filename);
+			close_connection(cnum, nowP);
+			return;
+		}
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (connections[cnum].conn_state != CNST_WRITING)
+			{
+				/* Only pipelined requests were left.  The server has
+				** gone away, and reading the connection will find that
+				** out and send them again.
+				*/
+				connections[cnum].unsent = 0;
+				return;
+			}
+			/* Only worth another try if this connection worked before. */
+			if (n > 1)
+			{
+				retry_connection(cnum, nowP);
+				return;
+			}
+			perror(urls[connections[cnum].url_num].url_str);
+			close_connection(cnum, nowP);
+			return;
+		}
+		st->total_sent_bytes += r;
+
+		/* Move the cursor past what went, a request at a time. */
+		connections_cold[cnum].send_off += r;
+		for (;;)
+		{
+			i = 1 + connections[cnum].pipe_count - connections[cnum].unsent;
+			size = request_size(cnum, i,
+			    keepalive_max > 0 && n + i >= keepalive_max);
+			if (connections_cold[cnum].send_off < size)
+				break;
+			connections_cold[cnum].send_off -= size;
+			request_sent(cnum, i, nowP);
+			if (--connections[cnum].unsent == 0)
+				break;
+		}
+	}
+	tmr_reset(nowP, connections[cnum].idle_timer);
+
+	/* With the first request out, start looking for its response. */
+	if (connections[cnum].conn_state == CNST_WRITING
+	    && connections[cnum].unsent <= connections[cnum].pipe_count)
+	{
+		connections[cnum].conn_state = CNST_HEADERS;
+		connections[cnum].header_state = HDST_LINE1_PROTOCOL;
+	}
+	if (connections[cnum].conn_state == CNST_WRITING)
+		fdwatch_mod_fd(connections[cnum].conn_fd, FDW_WRITE);
+	else if (connections[cnum].unsent > 0)
+		fdwatch_mod_fd(connections[cnum].conn_fd, FDW_READ | FDW_WRITE);
+	else
+		fdwatch_mod_fd(connections[cnum].conn_fd, FDW_READ);
+}
+
+static void retry_connection(int cnum, long long* nowP)
+{
+	int url_num, i;
+
+	/* The server gave up on this kept-alive connection before it saw our
+	** request.  That's not a failed fetch, so quietly start it over on a
+	** fresh connection, along with anything pipelined behind it.
+	*/
+	url_num = connections[cnum].url_num;
+	drop_connection(cnum);
+	/* It went on top of the free list; take it straight back. */
+	(void)take_slot();
+	start_socket(url_num, cnum, connections_cold[cnum].scheduled_at, nowP);
+	if (connections[cnum].conn_state == CNST_FREE)
+	{
+		count_parallel(-1 - connections[cnum].pipe_count);
+		for (i = 0; i <= connections[cnum].pipe_count; ++i)
+			free_url(queued_url(cnum, i));
+		connections[cnum].pipe_count = 0;
+	}
+}
+
+static void restart_pipeline(int cnum, long long* nowP)
+{
+	/* The server is closing the connection after a response, with more
+	** requests queued behind it.  They won't get answered here, so send
+	** them again on a new connection.
+	*/
+	record_fetch(cnum, nowP);
+	next_request(cnum, nowP);
+	retry_connection(cnum, nowP);
+}
+
+static void handle_idle(int cnum)
+{
+	char buf[100];
+	int r;
+
+	/* Nothing is expected on an idle connection, except the server
+	** closing it.
+	*/
+#ifdef USE_SSL
+	if ( connections_cold[cnum].ssl != (SSL*) 0 )
+	{
+		r = SSL_read( connections_cold[cnum].ssl, buf, sizeof(buf) );
+		if ( r < 0 && SSL_get_error( connections_cold[cnum].ssl, r )
+		    == SSL_ERROR_WANT_READ )
+		return;
+	}
+	else
+	r = read( connections[cnum].conn_fd, buf, sizeof(buf) );
+#else
+	r = read(connections[cnum].conn_fd, buf, sizeof(buf));
+#endif
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	drop_connection(cnum);
+}
+
+static void handle_read(int cnum, long long* nowP)
+{
+	char buf[30000]; /* must be larger than throttle / 2 */
+	int bytes_to_read, bytes_read;
+
+	tmr_reset(nowP, connections[cnum].idle_timer);
+
+	if (do_throttle && throttle / 2.0 < sizeof(buf))
+		bytes_to_read = throttle / 2.0;
+	else
+		bytes_to_read = sizeof(buf);
+
+	/* The descriptor is watched edge-triggered, so keep reading until it
+	** runs dry, or until the connection gets closed or paused.
+	*/
+	while (connections[cnum].conn_state == CNST_HEADERS
+	    || connections[cnum].conn_state == CNST_READING)
+	{
+#ifdef USE_SSL
+		if ( hosts[urls[connections[cnum].url_num].host].protocol == PROTO_HTTPS )
+		{
+			bytes_read = SSL_read( connections_cold[cnum].ssl, buf, bytes_to_read );
+			if ( bytes_read < 0 && SSL_get_error( connections_cold[cnum].ssl,
+			    bytes_read ) == SSL_ERROR_WANT_READ )
+			return;
+		}
+		else
+		bytes_read = read( connections[cnum].conn_fd, buf, bytes_to_read );
+#else
+		bytes_read = read(connections[cnum].conn_fd, buf, bytes_to_read);
+#endif
+		if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (bytes_read <= 0)
+		{
+			/* A kept-alive connection that closes before answering was
+			** most likely timed out by the server just as we reused it.
+			*/
+			if (!connections[cnum].did_response
+			    && connections[cnum].num_requests
+			        - connections[cnum].pipe_count > 1)
+				retry_connection(cnum, nowP);
+			else if (connections[cnum].pipe_count > 0)
+				restart_pipeline(cnum, nowP);
+			else
+				close_connection(cnum, nowP);
+			return;
+		}
+		handle_bytes(cnum, buf, bytes_read, nowP);
+	}
+}
+
+static void handle_bytes(int cnum, char* buf, int bytes_read,
+    long long* nowP)
+{
+	int bytes_handled, bytes_end, name_len;
+	float elapsed;
+	ClientData client_data;
 	register long checksum;
 
-	tmr_reset(nowP, connections[cnum].idle_timer);
+	for (bytes_handled = 0; bytes_handled < bytes_read;)
+	{
+		/* With pipelining, one read can hold the start of several
+		** responses, so note the first byte of each one.
+		*/
+		if (!connections[cnum].did_response)
+		{
+			connections[cnum].did_response = 1;
+			connections_cold[cnum].response_at = *nowP;
+		}
+		switch (connections[cnum].conn_state)
+		{
+		case CNST_HEADERS:
+			/* State machine to read until we reach the file part.  Looks for
+			 ** Content-Length header too.
+			 */
+			for (;
+			    bytes_handled < bytes_read
+			        && connections[cnum].conn_state == CNST_HEADERS;
+			    ++bytes_handled)
+			{
+				/* Most bytes are in lines that don't matter, and the names
+				** that do mostly come whole, so skip and match those a
+				** vector at a time.  The states below take the rest, like
+				** a name cut off by the end of the read.
+				*/
+				switch (connections[cnum].header_state)
+				{
+				case HDST_TEXT:
+					/* To the end of the line, or else the last byte, which
+					** gets skipped like the rest.
+					*/
+					bytes_handled = hdr_find_eol(&buf[bytes_handled],
+					    &buf[bytes_read - 1]) - buf;
+					break;
+				case HDST_BOL:
+				case HDST_LF:
+				case HDST_CR:
+				case HDST_CRLF:
+					if (buf[bytes_handled] == '\r' || buf[bytes_handled] == '\n')
+						break;
+					switch (hdr_name(&buf[bytes_handled], &buf[bytes_read],
+					    &name_len))
+					{
+					case HDR_OTHER:
+						connections[cnum].header_state = HDST_TEXT;
+						continue;
+					case HDR_CONTENT_LENGTH:
+						connections[cnum].header_state = HDST_CONTENT_LENGTH_COLON;
+						bytes_handled += name_len - 1;
+						continue;
+					case HDR_CONNECTION:
+						connections[cnum].header_state = HDST_CONNECTION_COLON;
+						bytes_handled += name_len - 1;
+						continue;
+					case HDR_TRANSFER_ENCODING:
+						connections[cnum].header_state =
+						    HDST_TRANSFER_ENCODING_COLON;
+						bytes_handled += name_len - 1;
+						continue;
+					}
+					break;
+				}
+
+				switch (connections[cnum].header_state)
+				{
+
+				case HDST_LINE1_PROTOCOL:
+					switch (buf[bytes_handled])
+					{
+					case ' ':
+					case '\t':
+						connections[cnum].header_state = HDST_LINE1_WHITESPACE;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						/* HTTP/1.1 keeps the connection open by default,
+						** HTTP/1.0 doesn't; the last digit tells which.
+						*/
+						connections[cnum].keep_alive =
+						    buf[bytes_handled] != '0';
+						break;
+					}
+					break;
+
+				case HDST_LINE1_WHITESPACE:
+					switch (buf[bytes_handled])
+					{
+					case ' ':
+					case '\t':
+						break;
+					case '0':
+					case '1':
+					case '2':
+					case '3':
+					case '4':
+					case '5':
+					case '6':
+					case '7':
+					case '8':
+					case '9':
+						connections[cnum].http_status = buf[bytes_handled]
+						    - '0';
+						connections[cnum].header_state = HDST_LINE1_STATUS;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_LINE1_STATUS:
+					switch (buf[bytes_handled])
+					{
+					case '0':
+					case '1':
+					case '2':
+					case '3':
+					case '4':
+					case '5':
+					case '6':
+					case '7':
+					case '8':
+					case '9':
+						connections[cnum].http_status =
+						    connections[cnum].http_status * 10
+						        + buf[bytes_handled] - '0';
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_BOL:
+					switch (buf[bytes_handled])
+					{
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					case 'C':
+					case 'c':
+						connections[cnum].header_state = HDST_C;
+						break;
+					case 'T':
+					case 't':
+						connections[cnum].header_state = HDST_T;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_TEXT:
+					switch (buf[bytes_handled])
+					{
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						break;
+					}
+					break;
+
+				case HDST_LF:
+					switch (buf[bytes_handled])
+					{
+					case '\n':
+						connections[cnum].conn_state = CNST_READING;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					case 'C':
+					case 'c':
+						connections[cnum].header_state = HDST_C;
+						break;
+					case 'T':
+					case 't':
+						connections[cnum].header_state = HDST_T;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CR:
+					switch (buf[bytes_handled])
+					{
+					case '\n':
+						connections[cnum].header_state = HDST_CRLF;
+						break;
+					case '\r':
+						connections[cnum].conn_state = CNST_READING;
+						break;
+					case 'C':
+					case 'c':
+						connections[cnum].header_state = HDST_C;
+						break;
+					case 'T':
+					case 't':
+						connections[cnum].header_state = HDST_T;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CRLF:
+					switch (buf[bytes_handled])
+					{
+					case '\n':
+						connections[cnum].conn_state = CNST_READING;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CRLFCR;
+						break;
+					case 'C':
+					case 'c':
+						connections[cnum].header_state = HDST_C;
+						break;
+					case 'T':
+					case 't':
+						connections[cnum].header_state = HDST_T;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CRLFCR:
+					switch (buf[bytes_handled])
+					{
+					case '\n':
+					case '\r':
+						connections[cnum].conn_state = CNST_READING;
+						break;
+					case 'C':
+					case 'c':
+						connections[cnum].header_state = HDST_C;
+						break;
+					case 'T':
+					case 't':
+						connections[cnum].header_state = HDST_T;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_C:
+					switch (buf[bytes_handled])
+					{
+					case 'O':
+					case 'o':
+						connections[cnum].header_state = HDST_CO;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CO:
+					switch (buf[bytes_handled])
+					{
+					case 'N':
+					case 'n':
+						connections[cnum].header_state = HDST_CON;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CON:
+					switch (buf[bytes_handled])
+					{
+					case 'T':
+					case 't':
+						connections[cnum].header_state = HDST_CONT;
+						break;
+					case 'N':
+					case 'n':
+						connections[cnum].header_state = HDST_CONN;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONT:
+					switch (buf[bytes_handled])
+					{
+					case 'E':
+					case 'e':
+						connections[cnum].header_state = HDST_CONTE;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONTE:
+					switch (buf[bytes_handled])
+					{
+					case 'N':
+					case 'n':
+						connections[cnum].header_state = HDST_CONTEN;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONTEN:
+					switch (buf[bytes_handled])
+					{
+					case 'T':
+					case 't':
+						connections[cnum].header_state = HDST_CONTENT;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONTENT:
+					switch (buf[bytes_handled])
+					{
+					case '-':
+						connections[cnum].header_state = HDST_CONTENT_;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONTENT_:
+					switch (buf[bytes_handled])
+					{
+					case 'L':
+					case 'l':
+						connections[cnum].header_state = HDST_CONTENT_L;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONTENT_L:
+					switch (buf[bytes_handled])
+					{
+					case 'E':
+					case 'e':
+						connections[cnum].header_state = HDST_CONTENT_LE;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONTENT_LE:
+					switch (buf[bytes_handled])
+					{
+					case 'N':
+					case 'n':
+						connections[cnum].header_state = HDST_CONTENT_LEN;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONTENT_LEN:
+					switch (buf[bytes_handled])
+					{
+					case 'G':
+					case 'g':
+						connections[cnum].header_state = HDST_CONTENT_LENG;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONTENT_LENG:
+					switch (buf[bytes_handled])
+					{
+					case 'T':
+					case 't':
+						connections[cnum].header_state = HDST_CONTENT_LENGT;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
 
-	if (do_throttle)
-		bytes_to_read = throttle / 2.0;
-	else
-		bytes_to_read = sizeof(buf);
-	if (!connections[cnum].did_response)
-	{
-		connections[cnum].did_response = 1;
-		connections[cnum].response_at = *nowP;
-	}
-#ifdef USE_SSL
-	if ( urls[connections[cnum].url_num].protocol == PROTO_HTTPS )
-	bytes_read = SSL_read( connections[cnum].ssl, buf, bytes_to_read );
-	else
-	bytes_read = read( connections[cnum].conn_fd, buf, bytes_to_read );
-#else
-	bytes_read = read(connections[cnum].conn_fd, buf, bytes_to_read);
-#endif
-	if (bytes_read <= 0)
-	{
-		close_connection(cnum);
-		return;
-	}
+				case HDST_CONTENT_LENGT:
+					switch (buf[bytes_handled])
+					{
+					case 'H':
+					case 'h':
+						connections[cnum].header_state = HDST_CONTENT_LENGTH;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
 
-	for (bytes_handled = 0; bytes_handled < bytes_read;)
-	{
-		switch (connections[cnum].conn_state)
-		{
-		case CNST_HEADERS:
-			/* State machine to read until we reach the file part.  Looks for
-			 ** Content-Length header too.
-			 */
-			for (;
-			    bytes_handled < bytes_read
-			        && connections[cnum].conn_state == CNST_HEADERS;
-			    ++bytes_handled)
-			{
-				switch (connections[cnum].header_state)
-				{
+				case HDST_CONTENT_LENGTH:
+					switch (buf[bytes_handled])
+					{
+					case ':':
+						connections[cnum].header_state =
+						    HDST_CONTENT_LENGTH_COLON;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
 
-				case HDST_LINE1_PROTOCOL:
+				case HDST_CONTENT_LENGTH_COLON:
 					switch (buf[bytes_handled])
 					{
 					case ' ':
 					case '\t':
-						connections[cnum].header_state = HDST_LINE1_WHITESPACE;
+						connections[cnum].header_state =
+						    HDST_CONTENT_LENGTH_COLON_WHITESPACE;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1145,10 +4114,13 @@ static void handle_read(int cnum, struct timeval* nowP)
 					case '\r':
 						connections[cnum].header_state = HDST_CR;
 						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
 					}
 					break;
 
-				case HDST_LINE1_WHITESPACE:
+				case HDST_CONTENT_LENGTH_COLON_WHITESPACE:
 					switch (buf[bytes_handled])
 					{
 					case ' ':
@@ -1164,9 +4136,10 @@ static void handle_read(int cnum, struct timeval* nowP)
 					case '7':
 					case '8':
 					case '9':
-						connections[cnum].http_status = buf[bytes_handled]
+						connections[cnum].content_length = buf[bytes_handled]
 						    - '0';
-						connections[cnum].header_state = HDST_LINE1_STATUS;
+						connections[cnum].header_state =
+						    HDST_CONTENT_LENGTH_COLON_WHITESPACE_NUM;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1180,7 +4153,7 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_LINE1_STATUS:
+				case HDST_CONTENT_LENGTH_COLON_WHITESPACE_NUM:
 					switch (buf[bytes_handled])
 					{
 					case '0':
@@ -1193,8 +4166,8 @@ static void handle_read(int cnum, struct timeval* nowP)
 					case '7':
 					case '8':
 					case '9':
-						connections[cnum].http_status =
-						    connections[cnum].http_status * 10
+						connections[cnum].content_length =
+						    connections[cnum].content_length * 10
 						        + buf[bytes_handled] - '0';
 						break;
 					case '\n':
@@ -1209,18 +4182,37 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_BOL:
+				case HDST_CONN:
 					switch (buf[bytes_handled])
 					{
+					case 'E':
+					case 'e':
+						connections[cnum].header_state = HDST_CONNE;
+						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
 						break;
 					case '\r':
 						connections[cnum].header_state = HDST_CR;
 						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONNE:
+					switch (buf[bytes_handled])
+					{
 					case 'C':
 					case 'c':
-						connections[cnum].header_state = HDST_C;
+						connections[cnum].header_state = HDST_CONNEC;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
 						break;
 					default:
 						connections[cnum].header_state = HDST_TEXT;
@@ -1228,9 +4220,13 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_TEXT:
+				case HDST_CONNEC:
 					switch (buf[bytes_handled])
 					{
+					case 'T':
+					case 't':
+						connections[cnum].header_state = HDST_CONNECT;
+						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
 						break;
@@ -1238,41 +4234,61 @@ static void handle_read(int cnum, struct timeval* nowP)
 						connections[cnum].header_state = HDST_CR;
 						break;
 					default:
+						connections[cnum].header_state = HDST_TEXT;
 						break;
 					}
 					break;
 
-				case HDST_LF:
+				case HDST_CONNECT:
 					switch (buf[bytes_handled])
 					{
+					case 'I':
+					case 'i':
+						connections[cnum].header_state = HDST_CONNECTI;
+						break;
 					case '\n':
-						connections[cnum].conn_state = CNST_READING;
+						connections[cnum].header_state = HDST_LF;
 						break;
 					case '\r':
 						connections[cnum].header_state = HDST_CR;
 						break;
-					case 'C':
-					case 'c':
-						connections[cnum].header_state = HDST_C;
-						break;
 					default:
 						connections[cnum].header_state = HDST_TEXT;
 						break;
 					}
 					break;
 
-				case HDST_CR:
+				case HDST_CONNECTI:
 					switch (buf[bytes_handled])
 					{
+					case 'O':
+					case 'o':
+						connections[cnum].header_state = HDST_CONNECTIO;
+						break;
 					case '\n':
-						connections[cnum].header_state = HDST_CRLF;
+						connections[cnum].header_state = HDST_LF;
 						break;
 					case '\r':
-						connections[cnum].conn_state = CNST_READING;
+						connections[cnum].header_state = HDST_CR;
 						break;
-					case 'C':
-					case 'c':
-						connections[cnum].header_state = HDST_C;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONNECTIO:
+					switch (buf[bytes_handled])
+					{
+					case 'N':
+					case 'n':
+						connections[cnum].header_state = HDST_CONNECTION;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
 						break;
 					default:
 						connections[cnum].header_state = HDST_TEXT;
@@ -1280,18 +4296,50 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CRLF:
+				case HDST_CONNECTION:
 					switch (buf[bytes_handled])
 					{
+					case ':':
+						connections[cnum].header_state =
+						    HDST_CONNECTION_COLON;
+						break;
 					case '\n':
-						connections[cnum].conn_state = CNST_READING;
+						connections[cnum].header_state = HDST_LF;
 						break;
 					case '\r':
-						connections[cnum].header_state = HDST_CRLFCR;
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_CONNECTION_COLON:
+				case HDST_CONNECTION_COLON_WHITESPACE:
+					/* Only the first letter of the value matters. */
+					switch (buf[bytes_handled])
+					{
+					case ' ':
+					case '\t':
+						connections[cnum].header_state =
+						    HDST_CONNECTION_COLON_WHITESPACE;
 						break;
 					case 'C':
 					case 'c':
-						connections[cnum].header_state = HDST_C;
+						connections[cnum].keep_alive = 0;
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					case 'K':
+					case 'k':
+						connections[cnum].keep_alive = 1;
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
 						break;
 					default:
 						connections[cnum].header_state = HDST_TEXT;
@@ -1299,16 +4347,18 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CRLFCR:
+				case HDST_T:
 					switch (buf[bytes_handled])
 					{
+					case 'R':
+					case 'r':
+						connections[cnum].header_state = HDST_TR;
+						break;
 					case '\n':
-					case '\r':
-						connections[cnum].conn_state = CNST_READING;
+						connections[cnum].header_state = HDST_LF;
 						break;
-					case 'C':
-					case 'c':
-						connections[cnum].header_state = HDST_C;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
 						break;
 					default:
 						connections[cnum].header_state = HDST_TEXT;
@@ -1316,12 +4366,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_C:
+				case HDST_TR:
 					switch (buf[bytes_handled])
 					{
-					case 'O':
-					case 'o':
-						connections[cnum].header_state = HDST_CO;
+					case 'A':
+					case 'a':
+						connections[cnum].header_state = HDST_TRA;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1335,12 +4385,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CO:
+				case HDST_TRA:
 					switch (buf[bytes_handled])
 					{
 					case 'N':
 					case 'n':
-						connections[cnum].header_state = HDST_CON;
+						connections[cnum].header_state = HDST_TRAN;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1354,12 +4404,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CON:
+				case HDST_TRAN:
 					switch (buf[bytes_handled])
 					{
-					case 'T':
-					case 't':
-						connections[cnum].header_state = HDST_CONT;
+					case 'S':
+					case 's':
+						connections[cnum].header_state = HDST_TRANS;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1373,12 +4423,31 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONT:
+				case HDST_TRANS:
+					switch (buf[bytes_handled])
+					{
+					case 'F':
+					case 'f':
+						connections[cnum].header_state = HDST_TRANSF;
+						break;
+					case '\n':
+						connections[cnum].header_state = HDST_LF;
+						break;
+					case '\r':
+						connections[cnum].header_state = HDST_CR;
+						break;
+					default:
+						connections[cnum].header_state = HDST_TEXT;
+						break;
+					}
+					break;
+
+				case HDST_TRANSF:
 					switch (buf[bytes_handled])
 					{
 					case 'E':
 					case 'e':
-						connections[cnum].header_state = HDST_CONTE;
+						connections[cnum].header_state = HDST_TRANSFE;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1392,12 +4461,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTE:
+				case HDST_TRANSFE:
 					switch (buf[bytes_handled])
 					{
-					case 'N':
-					case 'n':
-						connections[cnum].header_state = HDST_CONTEN;
+					case 'R':
+					case 'r':
+						connections[cnum].header_state = HDST_TRANSFER;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1411,12 +4480,11 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTEN:
+				case HDST_TRANSFER:
 					switch (buf[bytes_handled])
 					{
-					case 'T':
-					case 't':
-						connections[cnum].header_state = HDST_CONTENT;
+					case '-':
+						connections[cnum].header_state = HDST_TRANSFER_;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1430,11 +4498,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT:
+				case HDST_TRANSFER_:
 					switch (buf[bytes_handled])
 					{
-					case '-':
-						connections[cnum].header_state = HDST_CONTENT_;
+					case 'E':
+					case 'e':
+						connections[cnum].header_state = HDST_TRANSFER_E;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1448,12 +4517,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT_:
+				case HDST_TRANSFER_E:
 					switch (buf[bytes_handled])
 					{
-					case 'L':
-					case 'l':
-						connections[cnum].header_state = HDST_CONTENT_L;
+					case 'N':
+					case 'n':
+						connections[cnum].header_state = HDST_TRANSFER_EN;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1467,12 +4536,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT_L:
+				case HDST_TRANSFER_EN:
 					switch (buf[bytes_handled])
 					{
-					case 'E':
-					case 'e':
-						connections[cnum].header_state = HDST_CONTENT_LE;
+					case 'C':
+					case 'c':
+						connections[cnum].header_state = HDST_TRANSFER_ENC;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1486,12 +4555,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT_LE:
+				case HDST_TRANSFER_ENC:
 					switch (buf[bytes_handled])
 					{
-					case 'N':
-					case 'n':
-						connections[cnum].header_state = HDST_CONTENT_LEN;
+					case 'O':
+					case 'o':
+						connections[cnum].header_state = HDST_TRANSFER_ENCO;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1505,12 +4574,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT_LEN:
+				case HDST_TRANSFER_ENCO:
 					switch (buf[bytes_handled])
 					{
-					case 'G':
-					case 'g':
-						connections[cnum].header_state = HDST_CONTENT_LENG;
+					case 'D':
+					case 'd':
+						connections[cnum].header_state = HDST_TRANSFER_ENCOD;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1524,12 +4593,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT_LENG:
+				case HDST_TRANSFER_ENCOD:
 					switch (buf[bytes_handled])
 					{
-					case 'T':
-					case 't':
-						connections[cnum].header_state = HDST_CONTENT_LENGT;
+					case 'I':
+					case 'i':
+						connections[cnum].header_state = HDST_TRANSFER_ENCODI;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1543,12 +4612,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT_LENGT:
+				case HDST_TRANSFER_ENCODI:
 					switch (buf[bytes_handled])
 					{
-					case 'H':
-					case 'h':
-						connections[cnum].header_state = HDST_CONTENT_LENGTH;
+					case 'N':
+					case 'n':
+						connections[cnum].header_state = HDST_TRANSFER_ENCODIN;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1562,12 +4631,12 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT_LENGTH:
+				case HDST_TRANSFER_ENCODIN:
 					switch (buf[bytes_handled])
 					{
-					case ':':
-						connections[cnum].header_state =
-						    HDST_CONTENT_LENGTH_COLON;
+					case 'G':
+					case 'g':
+						connections[cnum].header_state = HDST_TRANSFER_ENCODING;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1581,13 +4650,11 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT_LENGTH_COLON:
+				case HDST_TRANSFER_ENCODING:
 					switch (buf[bytes_handled])
 					{
-					case ' ':
-					case '\t':
-						connections[cnum].header_state =
-						    HDST_CONTENT_LENGTH_COLON_WHITESPACE;
+					case ':':
+						connections[cnum].header_state = HDST_TRANSFER_ENCODING_COLON;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1601,26 +4668,21 @@ static void handle_read(int cnum, struct timeval* nowP)
 					}
 					break;
 
-				case HDST_CONTENT_LENGTH_COLON_WHITESPACE:
+				case HDST_TRANSFER_ENCODING_COLON:
+					/* The last coding listed is the one that frames the
+					** body; only its first letter matters.
+					*/
 					switch (buf[bytes_handled])
 					{
 					case ' ':
 					case '\t':
+					case ',':
 						break;
-					case '0':
-					case '1':
-					case '2':
-					case '3':
-					case '4':
-					case '5':
-					case '6':
-					case '7':
-					case '8':
-					case '9':
-						connections[cnum].content_length = buf[bytes_handled]
-						    - '0';
+					case 'C':
+					case 'c':
+						connections[cnum].chunked = 1;
 						connections[cnum].header_state =
-						    HDST_CONTENT_LENGTH_COLON_WHITESPACE_NUM;
+						    HDST_TRANSFER_ENCODING_COLON_TOKEN;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1629,27 +4691,19 @@ static void handle_read(int cnum, struct timeval* nowP)
 						connections[cnum].header_state = HDST_CR;
 						break;
 					default:
-						connections[cnum].header_state = HDST_TEXT;
+						connections[cnum].chunked = 0;
+						connections[cnum].header_state =
+						    HDST_TRANSFER_ENCODING_COLON_TOKEN;
 						break;
 					}
 					break;
 
-				case HDST_CONTENT_LENGTH_COLON_WHITESPACE_NUM:
+				case HDST_TRANSFER_ENCODING_COLON_TOKEN:
 					switch (buf[bytes_handled])
 					{
-					case '0':
-					case '1':
-					case '2':
-					case '3':
-					case '4':
-					case '5':
-					case '6':
-					case '7':
-					case '8':
-					case '9':
-						connections[cnum].content_length =
-						    connections[cnum].content_length * 10
-						        + buf[bytes_handled] - '0';
+					case ',':
+						connections[cnum].header_state =
+						    HDST_TRANSFER_ENCODING_COLON;
 						break;
 					case '\n':
 						connections[cnum].header_state = HDST_LF;
@@ -1658,35 +4712,117 @@ static void handle_read(int cnum, struct timeval* nowP)
 						connections[cnum].header_state = HDST_CR;
 						break;
 					default:
-						connections[cnum].header_state = HDST_TEXT;
 						break;
 					}
 					break;
 
 				}
 			}
+			if (connections[cnum].conn_state == CNST_READING)
+			{
+				/* A 1xx other than 101 is only an interim response, like
+				** 100 Continue; drop its headers and read the real one.
+				*/
+				if (connections[cnum].http_status >= 100
+				    && connections[cnum].http_status < 200
+				    && connections[cnum].http_status != 101)
+				{
+					connections[cnum].conn_state = CNST_HEADERS;
+					connections[cnum].header_state = HDST_LINE1_PROTOCOL;
+					connections[cnum].content_length = -1;
+					connections[cnum].chunked = 0;
+					connections[cnum].http_status = -1;
+					break;
+				}
+				/* Some responses never have a body, and nor does any
+				** response to a HEAD, whatever its Content-Length says.
+				*/
+				if (connections[cnum].head
+				    || (connections[cnum].http_status >= 100
+				        && connections[cnum].http_status < 200)
+				    || connections[cnum].http_status == 204
+				    || connections[cnum].http_status == 304)
+				{
+					connections[cnum].content_length = 0;
+					connections[cnum].chunked = 0;
+				}
+				/* A chunked body ignores any Content-Length. */
+				if (connections[cnum].chunked)
+				{
+					connections[cnum].content_length = -1;
+					connections[cnum].chunk_state = CHST_SIZE;
+					connections[cnum].chunk_left = 0;
+				}
+				if (connections[cnum].content_length == 0)
+				{
+					/* Carry on if the next response is already here. */
+					response_done(cnum, nowP);
+					if (connections[cnum].conn_state != CNST_HEADERS)
+						return;
+				}
+			}
 			break;
 
 		case CNST_READING:
-			connections[cnum].bytes += bytes_read - bytes_handled;
-			if (do_throttle)
+		case CNST_PAUSING:
+			if (connections[cnum].chunked
+			    && connections[cnum].chunk_state != CHST_DATA)
+			{
+				/* Between chunks, find the size of the next one. */
+				bytes_handled = handle_chunk_framing(cnum, buf, bytes_handled,
+				    bytes_read);
+				if (connections[cnum].chunk_state == CHST_BAD)
+				{
+					(void)fprintf(stderr, "%s: bad chunk size\n",
+					    urls[connections[cnum].url_num].url_str);
+					close_connection(cnum, nowP);
+					return;
+				}
+				if (connections[cnum].chunk_state == CHST_DONE)
+				{
+					response_done(cnum, nowP);
+					if (connections[cnum].conn_state != CNST_HEADERS)
+						return;
+				}
+				break;
+			}
+
+			/* Don't take anything past the end of this response, or of
+			** this chunk.
+			*/
+			bytes_end = bytes_read;
+			if (connections[cnum].chunked)
+			{
+				if (connections[cnum].chunk_left < bytes_read - bytes_handled)
+					bytes_end = bytes_handled + connections[cnum].chunk_left;
+				connections[cnum].chunk_left -= bytes_end - bytes_handled;
+				if (connections[cnum].chunk_left == 0)
+					connections[cnum].chunk_state = CHST_DATA_CR;
+			}
+			else if (connections[cnum].content_length != -1
+			    && connections[cnum].content_length - connections[cnum].bytes
+			        < bytes_read - bytes_handled)
+				bytes_end = bytes_handled + connections[cnum].content_length
+				    - connections[cnum].bytes;
+			connections[cnum].bytes += bytes_end - bytes_handled;
+			if (do_throttle && connections[cnum].conn_state == CNST_READING)
 			{
 				/* Check if we're reading too fast. */
-				elapsed = delta_timeval(&connections[cnum].started_at, nowP)
-				    / 1000000.0;
+				elapsed = (*nowP - connections_cold[cnum].started_at)
+				    / 1000000000.0;
 				if (elapsed > 0.01
 				    && connections[cnum].bytes / elapsed > throttle)
 				{
 					connections[cnum].conn_state = CNST_PAUSING;
 					client_data.i = cnum;
-					connections[cnum].wakeup_timer = tmr_create(nowP,
+					connections_cold[cnum].wakeup_timer = tmr_create(nowP,
 					    wakeup_connection, client_data, 1000L, 0);
 				}
 			}
 			if (do_checksum)
 			{
 				checksum = connections[cnum].checksum;
-				for (; bytes_handled < bytes_read; ++bytes_handled)
+				for (; bytes_handled < bytes_end; ++bytes_handled)
 				{
 					if (checksum & 1)
 						checksum = (checksum >> 1) + 0x8000;
@@ -1699,240 +4835,731 @@ static void handle_read(int cnum, struct timeval* nowP)
 			}
 			else
 			{
-				bytes_handled = bytes_read;
+				bytes_handled = bytes_end;
 			}
 
-			if (connections[cnum].content_length != -1
+			if (!connections[cnum].chunked
+			    && connections[cnum].content_length != -1
 			    && connections[cnum].bytes >= connections[cnum].content_length)
 			{
-				close_connection(cnum);
-				return;
+				response_done(cnum, nowP);
+				if (connections[cnum].conn_state != CNST_HEADERS)
+					return;
+			}
+
+			break;
+		}
+	}
+}
+
+static int handle_chunk_framing(int cnum, char* buf, int bytes_handled,
+    int bytes_read)
+{
+	int c;
+
+	/* Walk the chunk-size lines, the CRLFs after each chunk and the
+	** trailer, stopping at the start of chunk data or the end of the body.
+	*/
+	for (; bytes_handled < bytes_read; ++bytes_handled)
+	{
+		c = (unsigned char)buf[bytes_handled];
+		switch (connections[cnum].chunk_state)
+		{
+		case CHST_SIZE:
+			if (isxdigit(c))
+			{
+				/* A size too big for a long is no size at all. */
+				if (connections[cnum].chunk_left > (LONG_MAX - 15) / 16)
+				{
+					connections[cnum].chunk_state = CHST_BAD;
+					return bytes_handled;
+				}
+				connections[cnum].chunk_left =
+				    connections[cnum].chunk_left * 16
+				        + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+				break;
+			}
+			/* Anything else starts a chunk extension, which we skip. */
+			connections[cnum].chunk_state = CHST_EXT;
+			/* FALLTHROUGH */
+		case CHST_EXT:
+		case CHST_SIZE_CR:
+			if (c == '\r')
+				connections[cnum].chunk_state = CHST_SIZE_CR;
+			else if (c == '\n')
+			{
+				/* The last chunk has size zero; a trailer follows. */
+				if (connections[cnum].chunk_left == 0)
+					connections[cnum].chunk_state = CHST_TRAILER_BOL;
+				else
+				{
+					connections[cnum].chunk_state = CHST_DATA;
+					return bytes_handled + 1;
+				}
+			}
+			break;
+
+		case CHST_DATA_CR:
+			if (c == '\r')
+				connections[cnum].chunk_state = CHST_DATA_LF;
+			else if (c == '\n')
+				connections[cnum].chunk_state = CHST_SIZE;
+			break;
+
+		case CHST_DATA_LF:
+			if (c == '\n')
+				connections[cnum].chunk_state = CHST_SIZE;
+			break;
+
+		case CHST_TRAILER_BOL:
+			if (c == '\n')
+			{
+				connections[cnum].chunk_state = CHST_DONE;
+				return bytes_handled + 1;
 			}
+			if (c == '\r')
+				connections[cnum].chunk_state = CHST_TRAILER_CR;
+			else
+				connections[cnum].chunk_state = CHST_TRAILER_TEXT;
+			break;
+
+		case CHST_TRAILER_TEXT:
+			if (c == '\n')
+				connections[cnum].chunk_state = CHST_TRAILER_BOL;
+			break;
 
+		case CHST_TRAILER_CR:
+			if (c == '\n')
+			{
+				connections[cnum].chunk_state = CHST_DONE;
+				return bytes_handled + 1;
+			}
+			connections[cnum].chunk_state = CHST_TRAILER_TEXT;
 			break;
 		}
 	}
+	return bytes_handled;
 }
 
-static void idle_connection(ClientData client_data, struct timeval* nowP)
+static void idle_connection(ClientData client_data, long long* nowP)
 {
 	int cnum;
 
 	cnum = client_data.i;
 	connections[cnum].idle_timer = (Timer*)0;
+	if (connections[cnum].conn_state == CNST_IDLE)
+	{
+		/* Nobody wanted this kept-alive connection for a while. */
+		drop_connection(cnum);
+		return;
+	}
 	(void)fprintf(stderr, "%s: timed out\n",
 	    urls[connections[cnum].url_num].url_str);
-	close_connection(cnum);
-	++total_timeouts;
+	close_connection(cnum, nowP);
+	++st->total_timeouts;
 }
 
-static void wakeup_connection(ClientData client_data, struct timeval* nowP)
+static void wakeup_connection(ClientData client_data, long long* nowP)
 {
 	int cnum;
 
 	cnum = client_data.i;
-	connections[cnum].wakeup_timer = (Timer*)0;
+	connections_cold[cnum].wakeup_timer = (Timer*)0;
 	connections[cnum].conn_state = CNST_READING;
+	/* Data may have arrived while paused, and no new edge will tell us. */
+	handle_read(cnum, nowP);
 }
 
-static void close_connection(int cnum)
+static void response_done(int cnum, long long* nowP)
 {
-	int url_num;
+	if (connections[cnum].pipe_count > 0)
+	{
+		/* The next response follows right behind this one. */
+		if (!connections[cnum].keep_alive)
+		{
+			restart_pipeline(cnum, nowP);
+			return;
+		}
+		record_fetch(cnum, nowP);
+		next_request(cnum, nowP);
+		return;
+	}
+
+	/* Keep the connection for another request if both sides want to. */
+	if (do_keepalive && connections[cnum].keep_alive && !SHARED_GET(stopping)
+	    && (keepalive_max == 0
+	        || connections[cnum].num_requests < keepalive_max))
+		park_connection(cnum, nowP);
+	else
+		close_connection(cnum, nowP);
+}
+
+static void park_connection(int cnum, long long* nowP)
+{
+	int* head;
+
+	record_fetch(cnum, nowP);
+	if (connections_cold[cnum].wakeup_timer != (Timer*)0)
+	{
+		tmr_cancel(connections_cold[cnum].wakeup_timer);
+		connections_cold[cnum].wakeup_timer = (Timer*)0;
+	}
+
+	/* Push it on the idle list, whose tail is the one to take from when
+	** slots run out.  The idle timer keeps running.
+	*/
+	connections[cnum].conn_state = CNST_IDLE;
+	update_room(cnum, 0);
+	connections_cold[cnum].prev_idle = -1;
+	connections_cold[cnum].next_idle = idle_head;
+	if (idle_head != -1)
+		connections_cold[idle_head].prev_idle = cnum;
+	else
+		idle_tail = cnum;
+	idle_head = cnum;
+	/* And on its host's, for the next request there to find it. */
+	head = &host_idle_head[hosts[connections_cold[cnum].host].pool];
+	connections_cold[cnum].prev_host_idle = -1;
+	connections_cold[cnum].next_host_idle = *head;
+	if (*head != -1)
+		connections_cold[*head].prev_host_idle = cnum;
+	*head = cnum;
+	slot_opened();
+}
 
+static void unpark_connection(int cnum)
+{
+	if (connections_cold[cnum].prev_idle != -1)
+		connections_cold[connections_cold[cnum].prev_idle].next_idle =
+		    connections_cold[cnum].next_idle;
+	else
+		idle_head = connections_cold[cnum].next_idle;
+	if (connections_cold[cnum].next_idle != -1)
+		connections_cold[connections_cold[cnum].next_idle].prev_idle =
+		    connections_cold[cnum].prev_idle;
+	else
+		idle_tail = connections_cold[cnum].prev_idle;
+	if (connections_cold[cnum].prev_host_idle != -1)
+		connections_cold[connections_cold[cnum].prev_host_idle].next_host_idle =
+		    connections_cold[cnum].next_host_idle;
+	else
+		host_idle_head[hosts[connections_cold[cnum].host].pool] =
+		    connections_cold[cnum].next_host_idle;
+	if (connections_cold[cnum].next_host_idle != -1)
+		connections_cold[connections_cold[cnum].next_host_idle].prev_host_idle =
+		    connections_cold[cnum].prev_host_idle;
+}
+
+static void close_connection(int cnum, long long* nowP)
+{
+	record_fetch(cnum, nowP);
+	/* Requests pipelined behind it won't get answered either. */
+	while (connections[cnum].pipe_count > 0)
+	{
+		next_request(cnum, nowP);
+		record_fetch(cnum, nowP);
+	}
+	drop_connection(cnum);
+}
+
+static void drop_connection(int cnum)
+{
+	if (connections[cnum].conn_state == CNST_IDLE)
+		unpark_connection(cnum);
 #ifdef USE_SSL
-	if ( urls[connections[cnum].url_num].protocol == PROTO_HTTPS )
-	SSL_free( connections[cnum].ssl );
+	if ( connections_cold[cnum].ssl != (SSL*) 0 )
+	{
+		/* Without a close_notify OpenSSL takes the session for a bad one
+		** and won't resume it.
+		*/
+		if ( SSL_is_init_finished( connections_cold[cnum].ssl ) )
+			(void) SSL_shutdown( connections_cold[cnum].ssl );
+		SSL_free( connections_cold[cnum].ssl );
+		connections_cold[cnum].ssl = (SSL*) 0;
+	}
 #endif
+	fdwatch_del_fd(connections[cnum].conn_fd);
 	(void)close(connections[cnum].conn_fd);
-	connections[cnum].conn_state = CNST_FREE;
+	connections[cnum].unsent = 0;
+	free_slot(cnum);
+	--num_open;
 	if (connections[cnum].idle_timer != (Timer*)0)
+	{
 		tmr_cancel(connections[cnum].idle_timer);
-	if (connections[cnum].wakeup_timer != (Timer*)0)
-		tmr_cancel(connections[cnum].wakeup_timer);
-	--num_connections;
-	++fetches_completed;
-	total_bytes += connections[cnum].bytes;
-	if (connections[cnum].did_connect)
-	{
-		long long connect_usecs = delta_timeval(&connections[cnum].connect_at,
-		    &connections[cnum].request_at);
-		total_connect_usecs += connect_usecs;
-		max_connect_usecs = max( max_connect_usecs, connect_usecs );
-		min_connect_usecs = min( min_connect_usecs, connect_usecs );
-		++connects_completed;
+		connections[cnum].idle_timer = (Timer*)0;
+	}
+	if (connections_cold[cnum].wakeup_timer != (Timer*)0)
+	{
+		tmr_cancel(connections_cold[cnum].wakeup_timer);
+		connections_cold[cnum].wakeup_timer = (Timer*)0;
+	}
+}
+
+static int take_slot(void)
+{
+	int cnum;
+
+	/* The slot freed last is the likeliest to still be in cache. */
+	cnum = free_head;
+	if (cnum != -1)
+		free_head = connections_cold[cnum].next_free;
+	return cnum;
+}
+
+static void free_slot(int cnum)
+{
+	connections[cnum].conn_state = CNST_FREE;
+	update_room(cnum, 0);
+	connections_cold[cnum].next_free = free_head;
+	free_head = cnum;
+	slot_opened();
+}
+
+static void slot_opened(void)
+{
+	/* Let a start that found no slot have another go, from a timer so
+	** as not to start it in the middle of tearing this one down.
+	*/
+	if (start_waiting != (TimerProc*)0)
+	{
+		(void)tmr_create((long long*)0, start_waiting, JunkClientData, 0L, 0);
+		start_waiting = (TimerProc*)0;
+	}
+}
+
+static void count_parallel(int n)
+{
+	int all, peak;
+
+	/* Fetches started or finished.  With other workers running too, the
+	** peak is of everyone's at once, which costs a shared add.
+	*/
+	SHARED_ADD(st->num_connections, n);
+	if (st->num_connections > st->max_parallel)
+		st->max_parallel = st->num_connections;
+	if (num_workers > 1)
+	{
+		all = __atomic_add_fetch(&all_parallel, n, __ATOMIC_RELAXED);
+		peak = __atomic_load_n(&peak_parallel, __ATOMIC_RELAXED);
+		while (all > peak && !__atomic_compare_exchange_n(&peak_parallel,
+		    &peak, all, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+}
+
+static UrlReport* url_report(stats* s, int url_num)
+{
+	/* With millions of URLs most never get fetched, so they don't get
+	** a report, or its histograms, until they do.
+	*/
+	if (s->reports[url_num] == (UrlReport*)0)
+	{
+		s->reports[url_num] = (UrlReport*)malloc_check(sizeof(UrlReport));
+		(void)memset((void*)s->reports[url_num], 0, sizeof(UrlReport));
+		s->reports[url_num]->turn = url_num;
+		if (do_url_percentiles)
+		{
+			s->reports[url_num]->hists = (UrlHistograms*)malloc_check(
+			    sizeof(UrlHistograms));
+			(void)memset((void*)s->reports[url_num]->hists, 0,
+			    sizeof(UrlHistograms));
+		}
+	}
+	return s->reports[url_num];
+}
+
+static void record_fetch(int cnum, long long* nowP)
+{
+	int url_num;
+	UrlReport* r;
+
+	connections_cold[cnum].done_at = *nowP;
+	url_num = connections[cnum].url_num;
+	/* Each replayed line is a URL of its own, so they only get counted
+	** in the totals.
+	*/
+	r = start == START_REPLAY ? (UrlReport*)0 : url_report(st, url_num);
+	count_parallel(-1);
+	SHARED_ADD(st->fetches_completed, 1);
+	st->total_bytes += connections[cnum].bytes;
+	if (connections_cold[cnum].did_connect)
+	{
+		long long connect_nsecs = connections_cold[cnum].handshake_at
+		    - connections_cold[cnum].connect_at;
+		st->total_connect_nsecs += connect_nsecs;
+		st->max_connect_nsecs = max( st->max_connect_nsecs, connect_nsecs );
+		st->min_connect_nsecs = min( st->min_connect_nsecs, connect_nsecs );
+		++st->connects_completed;
+		hist_record(&st->connect_hist, connect_nsecs);
+		if (r != (UrlReport*)0 && r->hists != (UrlHistograms*)0)
+			hist_small_record(&r->hists->connect_hist, connect_nsecs);
 	}
 	if (connections[cnum].did_response)
 	{
-		long long response_usecs = delta_timeval(&connections[cnum].request_at,
-		    &connections[cnum].response_at);
-		total_response_usecs += response_usecs;
-		max_response_usecs = max( max_response_usecs, response_usecs );
-		min_response_usecs = min( min_response_usecs, response_usecs );
-		++responses_completed;
+		long long transfer_nsecs;
+		long long response_nsecs = connections_cold[cnum].response_at
+		    - connections_cold[cnum].request_at;
+		st->total_response_nsecs += response_nsecs;
+		st->max_response_nsecs = max( st->max_response_nsecs, response_nsecs );
+		st->min_response_nsecs = min( st->min_response_nsecs, response_nsecs );
+		++st->responses_completed;
+		hist_record(&st->first_hist, response_nsecs);
+		if (r != (UrlReport*)0 && r->hists != (UrlHistograms*)0)
+			hist_small_record(&r->hists->first_hist, response_nsecs);
+		/* Fetches that got no answer at all have no response time. */
+		response_nsecs = connections_cold[cnum].done_at
+		    - connections_cold[cnum].request_at;
+		hist_record(&st->response_hist, response_nsecs);
+		if (r != (UrlReport*)0 && r->hists != (UrlHistograms*)0)
+			hist_small_record(&r->hists->response_hist, response_nsecs);
+		/* Counting from when it should have started, so time spent
+		** waiting behind a stalled server isn't left out.
+		*/
+		if (start != START_PARALLEL)
+			hist_record(&st->scheduled_hist,
+			    connections_cold[cnum].done_at - connections_cold[cnum].scheduled_at);
+
+		transfer_nsecs = connections_cold[cnum].done_at
+		    - connections_cold[cnum].response_at;
+		hist_record(&st->transfer_hist, transfer_nsecs);
+		/* A response that came in a single read has no rate to speak of. */
+		if (transfer_nsecs > 0 && connections[cnum].bytes > 0)
+			hist_record(&st->throughput_hist,
+			    (long long)(connections[cnum].bytes * 1000000000.0
+			    / transfer_nsecs));
 	}
 	if (connections[cnum].http_status >= 0
 	    && connections[cnum].http_status <= 999)
-		++http_status_counts[connections[cnum].http_status];
+		++st->http_status_counts[connections[cnum].http_status];
+	if (r == (UrlReport*)0)
+	{
+		free_url(url_num);
+		return;
+	}
 
-	url_num = connections[cnum].url_num;
 
-	reports[url_num].turn = url_num;
-	if (!reports[url_num].http_status)
+	if (!r->http_status)
 	{
-		reports[url_num].http_status = connections[cnum].http_status;
-		reports[url_num].bytes = connections[cnum].bytes;
+		r->http_status = connections[cnum].http_status;
+		r->bytes = connections[cnum].bytes;
 	}
-	reports[url_num].fetches += 1;
+	r->fetches += 1;
 	if (connections[cnum].http_status != 200 && connections[cnum].http_status != 304)
 	{
-		reports[url_num].fails += 1;
+		r->fails += 1;
 	}
 
-	struct timeval spent  = {
-		.tv_sec = connections[cnum].response_at.tv_sec - connections[cnum].request_at.tv_sec,
-		.tv_usec = connections[cnum].response_at.tv_usec - connections[cnum].request_at.tv_usec
-	};
-	reports[url_num].total_time.tv_sec += spent.tv_sec;
-	reports[url_num].total_time.tv_usec += spent.tv_usec;
-	if (reports[url_num].max_time.tv_sec < spent.tv_sec ||
-		(reports[url_num].max_time.tv_sec == spent.tv_sec && reports[url_num].max_time.tv_usec < spent.tv_usec))
+	/* The whole response, not just the wait for it to start. */
+	long long spent = connections_cold[cnum].done_at - connections_cold[cnum].request_at;
+	r->total_time += spent;
+	if (r->max_time < spent)
 	{
-		reports[url_num].max_time = spent;
+		r->max_time = spent;
 	}
-	if (reports[url_num].min_time.tv_sec > spent.tv_sec ||
-		(reports[url_num].min_time.tv_sec == spent.tv_sec && reports[url_num].min_time.tv_usec > spent.tv_usec))
+	if (r->fetches == 1 ||
+		r->min_time > spent)
 	{
-		reports[url_num].min_time = spent;
+		r->min_time = spent;
 	}
 
 
+	/* A templated URL fetches something different every time. */
+	if (urls[url_num].num_segs > 0)
+		return;
 	if (do_checksum)
 	{
-		if (!urls[url_num].got_checksum)
+		if (!r->got_checksum)
 		{
-			urls[url_num].checksum = connections[cnum].checksum;
-			urls[url_num].got_checksum = 1;
+			r->expected_checksum = connections[cnum].checksum;
+			r->got_checksum = 1;
 		}
 		else
 		{
-			if (connections[cnum].checksum != urls[url_num].checksum)
+			if (connections[cnum].checksum
+			    != r->expected_checksum)
 			{
 				(void)fprintf(stderr, "%s: checksum wrong\n",
 				    urls[url_num].url_str);
-				++total_badchecksums;
-				++reports[url_num].fails;
+				++st->total_badchecksums;
+				++r->fails;
 			}
 		}
 	}
 	else
 	{
-		if (!urls[url_num].got_bytes)
+		if (!r->got_bytes)
 		{
-			urls[url_num].bytes = connections[cnum].bytes;
-			urls[url_num].got_bytes = 1;
+			r->expected_bytes = connections[cnum].bytes;
+			r->got_bytes = 1;
 		}
 		else
 		{
-			if (connections[cnum].bytes != urls[url_num].bytes)
+			if (connections[cnum].bytes
+			    != r->expected_bytes)
 			{
 				(void)fprintf(stderr, "%s: byte count wrong\n",
 				    urls[url_num].url_str);
-				++total_badbytes;
-				++reports[url_num].fails;
+				++st->total_badbytes;
+				++r->fails;
 			}
 		}
 	}
 }
 
-static void progress_report(ClientData client_data, struct timeval* nowP)
+static void progress_report(ClientData client_data, long long* nowP)
 {
 	float elapsed;
+	int w, started, completed, current;
 
-	elapsed = delta_timeval(&start_at, nowP) / 1000000.0;
+	/* Peeks at the other workers' counters unlocked; it's just progress. */
+	started = completed = current = 0;
+	for (w = 0; w < num_workers; ++w)
+	{
+		started += SHARED_GET(workers[w].st.fetches_started);
+		completed += SHARED_GET(workers[w].st.fetches_completed);
+		current += SHARED_GET(workers[w].st.num_connections);
+	}
+	elapsed = (*nowP - start_at) / 1000000000.0;
 	(void)fprintf(stderr,
 	    "--- %g secs, %d fetches started, %d completed, %d current\n", elapsed,
-	    fetches_started, fetches_completed, num_connections);
+	    started, completed, current);
+}
+
+static void start_timer(ClientData client_data, long long* nowP)
+{
+	long long wait;
+
+	/* Start every fetch that has come due since the last tick.  If we
+	** can't, the rest wait for a free connection, keeping their place in
+	** the schedule, and the timer isn't set again till one opens up.
+	*/
+	while (next_start_at <= *nowP && !SHARED_GET(stopping))
+	{
+		if (start_connection(pick_url(), next_start_at, nowP) < 0)
+		{
+			if (!start_behind)
+				(void)fprintf(stderr,
+				    "%s: ran out of connection slots, falling behind\n",
+				    argv0);
+			start_behind = 1;
+			start_waiting = start_timer;
+			return;
+		}
+		if (do_jitter)
+			next_start_at += fast_random() % range_interval + low_interval;
+		else
+			next_start_at += start_interval;
+	}
+
+	wait = next_start_at - *nowP;
+	if (wait < 0)
+		wait = 0;
+	(void)tmr_create(nowP, start_timer, JunkClientData,
+	    (long)((wait + 999999LL) / 1000000LL), 0);
 }
 
-static void start_timer(ClientData client_data, struct timeval* nowP)
+static void replay_timer(ClientData client_data, long long* nowP)
 {
-	start_connection(nowP);
-	if (do_jitter)
-		(void)tmr_create(nowP, start_timer, JunkClientData,
-		    (long)(random() % range_interval) + low_interval, 0);
+	long long wait;
+
+	/* Start every line that has come due, in order.  As with -rate, if
+	** one can't start the rest wait behind it for a free connection.
+	*/
+	while (replay_url != -1 && replay_at <= *nowP && !SHARED_GET(stopping))
+	{
+		if (start_connection(replay_url, replay_at, nowP) < 0)
+		{
+			if (!start_behind)
+				(void)fprintf(stderr,
+				    "%s: ran out of connection slots, falling behind\n",
+				    argv0);
+			start_behind = 1;
+			start_waiting = replay_timer;
+			return;
+		}
+		replay_url = next_replay_url();
+	}
+	if (replay_url == -1)
+		return;
+
+	wait = replay_at - *nowP;
+	if (wait < 0)
+		wait = 0;
+	(void)tmr_create(nowP, replay_timer, JunkClientData,
+	    (long)((wait + 999999LL) / 1000000LL), 0);
 }
 
-static void end_timer(ClientData client_data, struct timeval* nowP)
+static void end_timer(ClientData client_data, long long* nowP)
 {
-	finish(nowP);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
 }
 
-static void finish(struct timeval* nowP)
+static void finish(long long* nowP)
 {
 	float elapsed;
-	int i;
+	int i, w;
+	stats total;
+	UrlHistograms* h;
+
+	/* Add up what all the workers did. */
+	(void)memset((void*)&total, 0, sizeof(total));
+	total.min_connect_nsecs = 1000000000000000LL;
+	total.min_response_nsecs = 1000000000000000LL;
+	total.reports = (UrlReport**)malloc_check(num_urls * sizeof(UrlReport*));
+	(void)memset((void*)total.reports, 0, num_urls * sizeof(UrlReport*));
+	for (w = 0; w < num_workers; ++w)
+		merge_stats(&total, &workers[w].st);
+	if (num_workers > 1)
+		total.max_parallel = peak_parallel;
 
 	/* Report statistics. */
-	elapsed = delta_timeval(&start_at, nowP) / 1000000.0;
+	elapsed = (*nowP - start_at) / 1000000000.0;
 	(void)printf("%d fetches, %d max parallel, %g bytes, in %g seconds\n",
-	    fetches_completed, max_parallel, (float)total_bytes, elapsed);
-	if (fetches_completed > 0)
+	    total.fetches_completed, total.max_parallel, (float)total.total_bytes, elapsed);
+	if (total.fetches_completed > 0)
 		(void)printf("%g mean bytes/connection\n",
-		    (float)total_bytes / (float)fetches_completed);
+		    (float)total.total_bytes / (float)total.fetches_completed);
 	if (elapsed > 0.01)
 	{
 		(void)printf("%g fetches/sec, %g bytes/sec\n",
-		    (float)fetches_completed / elapsed, (float)total_bytes / elapsed);
+		    (float)total.fetches_completed / elapsed, (float)total.total_bytes / elapsed);
 	}
-	if (connects_completed > 0)
+	if (total.connects_completed > 0)
 		(void)printf("msecs/connect: %g mean, %g max, %g min\n",
-		    (float)total_connect_usecs / (float)connects_completed / 1000.0,
-		    (float)max_connect_usecs / 1000.0,
-		    (float)min_connect_usecs / 1000.0);
-	if (responses_completed > 0)
+		    (float)total.total_connect_nsecs / (float)total.connects_completed / 1000000.0,
+		    (float)total.max_connect_nsecs / 1000000.0,
+		    (float)total.min_connect_nsecs / 1000000.0);
+	if (total.handshake_hist.count > 0)
+	{
+		(void)printf("msecs/handshake: %g mean, %g max, %g min\n",
+		    (float)total.handshake_hist.total / (float)total.handshake_hist.count / 1000000.0,
+		    (float)total.handshake_hist.max / 1000000.0,
+		    (float)total.handshake_hist.min / 1000000.0);
+		(void)printf("%lld handshakes, %d resumed\n",
+		    total.handshake_hist.count, total.handshakes_resumed);
+#ifdef USE_SSL
+		if ( alpn != (unsigned char*) 0 )
+			(void) printf( "%d agreed on an ALPN protocol\n", total.alpn_agreed );
+#endif
+	}
+	if (total.early_accepted + total.early_rejected > 0)
+		(void)printf("%d requests as early data, %d of them turned down\n",
+		    total.early_accepted + total.early_rejected, total.early_rejected);
+	if (do_keepalive && total.connects_completed > 0)
+		(void)printf("%d connections, %g fetches/connection\n",
+		    total.connects_completed,
+		    (float)total.fetches_completed / (float)total.connects_completed);
+	if (total.responses_completed > 0)
 		(void)printf("msecs/first-response: %g mean, %g max, %g min\n",
-		    (float)total_response_usecs / (float)responses_completed / 1000.0,
-		    (float)max_response_usecs / 1000.0,
-		    (float)min_response_usecs / 1000.0);
-	if (total_timeouts != 0)
-		(void)printf("%d timeouts\n", total_timeouts);
+		    (float)total.total_response_nsecs / (float)total.responses_completed / 1000000.0,
+		    (float)total.max_response_nsecs / 1000000.0,
+		    (float)total.min_response_nsecs / 1000000.0);
+	if (total.response_hist.count > 0)
+		(void)printf("msecs/response: %g mean, %g max, %g min\n",
+		    (float)total.response_hist.total / (float)total.response_hist.count / 1000000.0,
+		    (float)total.response_hist.max / 1000000.0,
+		    (float)total.response_hist.min / 1000000.0);
+	if (total.transfer_hist.count > 0)
+		(void)printf("msecs/transfer: %g mean, %g max, %g min\n",
+		    (float)total.transfer_hist.total / (float)total.transfer_hist.count / 1000000.0,
+		    (float)total.transfer_hist.max / 1000000.0,
+		    (float)total.transfer_hist.min / 1000000.0);
+	print_percentiles("msecs/connect", &total.connect_hist);
+	print_percentiles("msecs/handshake", &total.handshake_hist);
+	print_percentiles("msecs/first-response", &total.first_hist);
+	print_percentiles("msecs/response", &total.response_hist);
+	print_percentiles("msecs/transfer", &total.transfer_hist);
+	if (total.scheduled_hist.count > 0)
+	{
+		(void)printf("msecs/scheduled-response: %g mean, %g max, %g min\n",
+		    (float)total.scheduled_hist.total / (float)total.scheduled_hist.count / 1000000.0,
+		    (float)total.scheduled_hist.max / 1000000.0,
+		    (float)total.scheduled_hist.min / 1000000.0);
+		print_percentiles("msecs/scheduled-response", &total.scheduled_hist);
+	}
+	if (total.upload_hist.count > 0)
+	{
+		(void)printf("%d uploads, %g bytes sent, %g sent bytes/sec\n",
+		    (int)total.upload_hist.count, (float)total.total_sent_bytes,
+		    elapsed > 0.01 ? (float)total.total_sent_bytes / elapsed : 0.0);
+		(void)printf("msecs/upload: %g mean, %g max, %g min\n",
+		    (float)total.upload_hist.total / (float)total.upload_hist.count / 1000000.0,
+		    (float)total.upload_hist.max / 1000000.0,
+		    (float)total.upload_hist.min / 1000000.0);
+		print_percentiles("msecs/upload", &total.upload_hist);
+	}
+	/* For throughput it's the slow end that matters. */
+	if (total.throughput_hist.count > 0)
+		(void)printf("bytes/sec/fetch percentiles: %g p1, %g p10, %g p50, %g p90, %g max\n",
+		    (float)hist_percentile(&total.throughput_hist, 1.0),
+		    (float)hist_percentile(&total.throughput_hist, 10.0),
+		    (float)hist_percentile(&total.throughput_hist, 50.0),
+		    (float)hist_percentile(&total.throughput_hist, 90.0),
+		    (float)total.throughput_hist.max);
+	if (total.total_timeouts != 0)
+		(void)printf("%d timeouts\n", total.total_timeouts);
 	if (do_checksum)
 	{
-		if (total_badchecksums != 0)
-			(void)printf("%d bad checksums\n", total_badchecksums);
+		if (total.total_badchecksums != 0)
+			(void)printf("%d bad checksums\n", total.total_badchecksums);
 	}
 	else
 	{
-		if (total_badbytes != 0)
-			(void)printf("%d bad byte counts\n", total_badbytes);
+		if (total.total_badbytes != 0)
+			(void)printf("%d bad byte counts\n", total.total_badbytes);
 	}
 
 	(void)printf("HTTP response codes:\n");
 	for (i = 0; i < 1000; ++i)
-		if (http_status_counts[i] > 0)
-			(void)printf("  code %03d -- %d\n", i, http_status_counts[i]);
+		if (total.http_status_counts[i] > 0)
+			(void)printf("  code %03d -- %d\n", i, total.http_status_counts[i]);
 
+	/* Replayed lines have no per-URL reports. */
+	if (start == START_REPLAY)
+		exit(0);
 
 	(void)printf("-----------------------------------------------------------------\n");
 	(void)printf("%-16s%-10s%-10s%-12s%-10s%-14s%-8s%-10s%-8s%s\n", "pps", "requests", "fails", "process", "min", "max", "status", "doc-len", "weight", "url");
 	for (i = 0; i < num_urls; ++i)
 	{
+		if (total.reports[i] == (UrlReport*)0)
+			continue;
 		(void)printf("\033[32;49;5m%-16f\033[0m%-10d\033[32;31;5m%-10d\033[0m%-12f%-10f%-14f%-8d%-10d%-8d%s\n",
-			reports[i].fetches / (reports[i].total_time.tv_sec + reports[i].total_time.tv_usec / 1000000.0),
-			reports[i].fetches,
-			reports[i].fails,
-			(reports[i].total_time.tv_sec + reports[i].total_time.tv_usec / 1000000.0) / reports[i].fetches,
-			reports[i].min_time.tv_sec + reports[i].min_time.tv_usec / 1000000.0,
-			reports[i].max_time.tv_sec + reports[i].max_time.tv_usec / 1000000.0,
-			reports[i].http_status,
-			reports[i].bytes,
-			urls[reports[i].turn].weight,
-			urls[reports[i].turn].url_str
+			total.reports[i]->fetches / (total.reports[i]->total_time / 1000000000.0),
+			total.reports[i]->fetches,
+			total.reports[i]->fails,
+			total.reports[i]->total_time / 1000000000.0 / total.reports[i]->fetches,
+			total.reports[i]->min_time / 1000000000.0,
+			total.reports[i]->max_time / 1000000000.0,
+			total.reports[i]->http_status,
+			total.reports[i]->bytes,
+			urls[total.reports[i]->turn].weight,
+			urls[total.reports[i]->turn].url_str
 		);
 	}
 	(void)printf("-----------------------------------------------------------------\n");
+	if (do_url_percentiles)
+	{
+		(void)printf("%-12s%-12s%-12s%-12s%-12s%-12s%-12s%s\n", "connect-p50", "connect-p99", "first-p50", "first-p99", "resp-p50", "resp-p99", "resp-p99.9", "url (msecs)");
+		for (i = 0; i < num_urls; ++i)
+		{
+			if (total.reports[i] == (UrlReport*)0)
+				continue;
+			h = total.reports[i]->hists;
+			(void)printf("%-12g%-12g%-12g%-12g%-12g%-12g%-12g%s\n",
+				hist_small_percentile(&h->connect_hist, 50.0) / 1000000.0,
+				hist_small_percentile(&h->connect_hist, 99.0) / 1000000.0,
+				hist_small_percentile(&h->first_hist, 50.0) / 1000000.0,
+				hist_small_percentile(&h->first_hist, 99.0) / 1000000.0,
+				hist_small_percentile(&h->response_hist, 50.0) / 1000000.0,
+				hist_small_percentile(&h->response_hist, 99.0) / 1000000.0,
+				hist_small_percentile(&h->response_hist, 99.9) / 1000000.0,
+				urls[i].url_str
+			);
+		}
+		(void)printf("-----------------------------------------------------------------\n");
+	}
 
-	tmr_destroy();
 #ifdef USE_SSL
 	if ( ssl_ctx != (SSL_CTX*) 0 )
 	SSL_CTX_free( ssl_ctx );
@@ -1940,13 +5567,86 @@ static void finish(struct timeval* nowP)
 	exit(0);
 }
 
-static long long delta_timeval(struct timeval* start, struct timeval* finish)
+static void print_percentiles(char* what, Histogram* h)
 {
-	long long delta_secs = finish->tv_sec - start->tv_sec;
-	long long delta_usecs = finish->tv_usec - start->tv_usec;
-	return delta_secs * (long long)1000000L + delta_usecs;
+	if (h->count == 0)
+		return;
+	(void)printf("%s percentiles: %g p50, %g p90, %g p99, %g p99.9, %g p99.99\n",
+	    what, hist_percentile(h, 50.0) / 1000000.0,
+	    hist_percentile(h, 90.0) / 1000000.0,
+	    hist_percentile(h, 99.0) / 1000000.0,
+	    hist_percentile(h, 99.9) / 1000000.0,
+	    hist_percentile(h, 99.99) / 1000000.0);
+}
+
+static void merge_stats(stats* total, stats* s)
+{
+	int i;
+	UrlReport* tr;
+	UrlReport* sr;
+
+	total->fetches_started += s->fetches_started;
+	total->connects_completed += s->connects_completed;
+	total->responses_completed += s->responses_completed;
+	total->fetches_completed += s->fetches_completed;
+	total->num_connections += s->num_connections;
+	total->max_parallel = max( total->max_parallel, s->max_parallel );
+	total->total_bytes += s->total_bytes;
+	total->total_sent_bytes += s->total_sent_bytes;
+	total->total_connect_nsecs += s->total_connect_nsecs;
+	total->max_connect_nsecs = max( total->max_connect_nsecs, s->max_connect_nsecs );
+	total->min_connect_nsecs = min( total->min_connect_nsecs, s->min_connect_nsecs );
+	total->total_response_nsecs += s->total_response_nsecs;
+	total->max_response_nsecs = max( total->max_response_nsecs, s->max_response_nsecs );
+	total->min_response_nsecs = min( total->min_response_nsecs, s->min_response_nsecs );
+	total->total_timeouts += s->total_timeouts;
+	total->total_badbytes += s->total_badbytes;
+	total->total_badchecksums += s->total_badchecksums;
+	for (i = 0; i < 1000; ++i)
+		total->http_status_counts[i] += s->http_status_counts[i];
+	hist_merge(&total->connect_hist, &s->connect_hist);
+	hist_merge(&total->first_hist, &s->first_hist);
+	hist_merge(&total->response_hist, &s->response_hist);
+	hist_merge(&total->transfer_hist, &s->transfer_hist);
+	hist_merge(&total->throughput_hist, &s->throughput_hist);
+	hist_merge(&total->scheduled_hist, &s->scheduled_hist);
+	hist_merge(&total->upload_hist, &s->upload_hist);
+	hist_merge(&total->handshake_hist, &s->handshake_hist);
+	total->handshakes_resumed += s->handshakes_resumed;
+	total->alpn_agreed += s->alpn_agreed;
+	total->early_accepted += s->early_accepted;
+	total->early_rejected += s->early_rejected;
+
+	for (i = 0; i < num_urls; ++i)
+	{
+		sr = s->reports[i];
+		if (sr == (UrlReport*)0)
+			continue;
+		tr = url_report(total, i);
+		if (!tr->http_status)
+		{
+			tr->http_status = sr->http_status;
+			tr->bytes = sr->bytes;
+		}
+		if (tr->fetches == 0 || sr->min_time < tr->min_time)
+			tr->min_time = sr->min_time;
+		if (sr->max_time > tr->max_time)
+			tr->max_time = sr->max_time;
+		tr->fetches += sr->fetches;
+		tr->fails += sr->fails;
+		tr->total_time += sr->total_time;
+		if (sr->hists != (UrlHistograms*)0)
+		{
+			hist_small_merge(&tr->hists->connect_hist, &sr->hists->connect_hist);
+			hist_small_merge(&tr->hists->first_hist, &sr->hists->first_hist);
+			hist_small_merge(&tr->hists->response_hist,
+			    &sr->hists->response_hist);
+		}
+	}
 }
 
+
+
 static void*
 malloc_check(size_t size)
 {
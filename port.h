@@ -79,6 +79,10 @@
 # define HAVE_LINUX_SENDFILE
 # define HAVE_SCANDIR
 # define HAVE_INT64T
+# define HAVE_SCHED_SETAFFINITY
+# ifndef NO_EPOLL
+#  define HAVE_EPOLL
+# endif
 #endif /* OS_Linux */
 
 #ifdef OS_Solaris
@@ -0,0 +1,320 @@
+/* respcheck.c - check http_load's framing of awkward responses
+**
+** Serves three kinds of response on a loopback port and runs http_load
+** against each, one connection per fetch, with keep-alive and with
+** pipelining.  /head answers a HEAD with a Content-Length and, as it
+** should, no body; /continue sends a 100 Continue ahead of the real
+** response; /bigchunk starts a chunked body with a size too big for a
+** long.  If http_load took the HEAD's Content-Length as a body, or the
+** 100 as a whole response, it would wait for bytes that never come or
+** count the wrong ones, and an overflowed chunk size could leave it
+** spinning on one read.  Each run has to finish every fetch with the
+** right byte count and well inside the timeout, all with code 200 but
+** for /bigchunk, where a connection gets closed with its pipelined
+** requests unanswered.
+** http_load's complaints about the bad chunks go to /dev/null.
+**
+** Usage: respcheck [path-to-http_load]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define FETCHES 20
+#define TIMEOUT "1"
+#define MAX_CLIENTS 32
+#define BUF_SIZE 8192
+
+static const char head_response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 1000\r\n"
+    "\r\n";
+
+static const char continue_response[] =
+    "HTTP/1.1 100 Continue\r\n"
+    "\r\n"
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 5\r\n"
+    "\r\n"
+    "hello";
+
+static const char bigchunk_response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "\r\n"
+    "8000000000000000\r\n"
+    "hello\r\n";
+
+typedef struct {
+    int fd;
+    int len;
+    char buf[BUF_SIZE];
+    } client;
+
+static client clients[MAX_CLIENTS];
+static int listen_fd;
+static int port;
+
+
+static void
+drop( client* c )
+    {
+    (void) close( c->fd );
+    c->fd = -1;
+    }
+
+
+static void
+send_all( client* c, const char* text, int len )
+    {
+    int r;
+
+    while ( len > 0 )
+	{
+	r = write( c->fd, text, len );
+	if ( r <= 0 )
+	    return;
+	text += r;
+	len -= r;
+	}
+    }
+
+
+/* Answer every whole request in the client's buffer. */
+static void
+answer( client* c )
+    {
+    char* end;
+    int len, closing;
+
+    while ( ( end = strstr( c->buf, "\r\n\r\n" ) ) != (char*) 0 )
+	{
+	*end = '\0';
+	closing = strstr( c->buf, "Connection: close" ) != (char*) 0;
+	if ( strncmp( c->buf, "HEAD /head ", 11 ) == 0 )
+	    send_all( c, head_response, sizeof(head_response) - 1 );
+	else if ( strncmp( c->buf, "GET /continue ", 14 ) == 0 )
+	    send_all( c, continue_response, sizeof(continue_response) - 1 );
+	else if ( strncmp( c->buf, "GET /bigchunk ", 14 ) == 0 )
+	    send_all( c, bigchunk_response, sizeof(bigchunk_response) - 1 );
+	else
+	    {
+	    (void) fprintf( stderr, "respcheck: unexpected request: %.40s\n", c->buf );
+	    closing = 1;
+	    }
+	if ( closing )
+	    {
+	    drop( c );
+	    return;
+	    }
+	len = c->len - ( end + 4 - c->buf );
+	(void) memmove( c->buf, end + 4, len + 1 );
+	c->len = len;
+	}
+    }
+
+
+/* Serve until http_load's output pipe closes, collecting the output. */
+static void
+serve( int out_fd, char* out, int out_size )
+    {
+    struct pollfd pfds[MAX_CLIENTS + 2];
+    int i, n, r, out_len, fd;
+
+    out_len = 0;
+    for ( i = 0; i < MAX_CLIENTS; ++i )
+	clients[i].fd = -1;
+    for (;;)
+	{
+	pfds[0].fd = out_fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = listen_fd;
+	pfds[1].events = POLLIN;
+	for ( i = 0; i < MAX_CLIENTS; ++i )
+	    {
+	    pfds[i + 2].fd = clients[i].fd;
+	    pfds[i + 2].events = POLLIN;
+	    }
+	if ( poll( pfds, MAX_CLIENTS + 2, -1 ) < 0 )
+	    {
+	    perror( "poll" );
+	    exit( 1 );
+	    }
+	if ( pfds[0].revents )
+	    {
+	    r = read( out_fd, &out[out_len], out_size - 1 - out_len );
+	    if ( r <= 0 )
+		break;
+	    out_len += r;
+	    }
+	if ( pfds[1].revents )
+	    {
+	    fd = accept( listen_fd, (struct sockaddr*) 0, (socklen_t*) 0 );
+	    for ( i = 0; i < MAX_CLIENTS && clients[i].fd != -1; ++i )
+		;
+	    if ( i == MAX_CLIENTS )
+		(void) close( fd );
+	    else if ( fd >= 0 )
+		{
+		clients[i].fd = fd;
+		clients[i].len = 0;
+		clients[i].buf[0] = '\0';
+		}
+	    }
+	for ( i = 0; i < MAX_CLIENTS; ++i )
+	    {
+	    if ( clients[i].fd == -1 || pfds[i + 2].fd == -1 ||
+		 ! pfds[i + 2].revents )
+		continue;
+	    n = BUF_SIZE - 1 - clients[i].len;
+	    r = read( clients[i].fd, &clients[i].buf[clients[i].len], n );
+	    if ( r <= 0 )
+		{
+		drop( &clients[i] );
+		continue;
+		}
+	    clients[i].len += r;
+	    clients[i].buf[clients[i].len] = '\0';
+	    answer( &clients[i] );
+	    }
+	}
+    out[out_len] = '\0';
+    for ( i = 0; i < MAX_CLIENTS; ++i )
+	if ( clients[i].fd != -1 )
+	    drop( &clients[i] );
+    }
+
+
+static int
+run( const char* http_load, const char* path, const char* method, int doc_len, int all_200, char** mode )
+    {
+    char url_file[] = "/tmp/respcheck.XXXXXX";
+    char out[BUF_SIZE], line[100], fetches_arg[20];
+    char* args[20];
+    int fd, pipe_fds[2], nargs, status, fetches, max_parallel, ok;
+    double bytes, seconds;
+    pid_t pid;
+    FILE* fp;
+
+    fd = mkstemp( url_file );
+    if ( fd < 0 || ( fp = fdopen( fd, "w" ) ) == (FILE*) 0 )
+	{
+	perror( url_file );
+	exit( 1 );
+	}
+    (void) fprintf( fp, "1 http://127.0.0.1:%d/%s %s\n", port, path, method );
+    (void) fclose( fp );
+
+    nargs = 0;
+    args[nargs++] = (char*) http_load;
+    args[nargs++] = "-parallel";
+    args[nargs++] = "2";
+    args[nargs++] = "-fetches";
+    (void) snprintf( fetches_arg, sizeof(fetches_arg), "%d", FETCHES );
+    args[nargs++] = fetches_arg;
+    args[nargs++] = "-timeout";
+    args[nargs++] = TIMEOUT;
+    for ( ; *mode != (char*) 0; ++mode )
+	args[nargs++] = *mode;
+    args[nargs++] = url_file;
+    args[nargs] = (char*) 0;
+
+    if ( pipe( pipe_fds ) < 0 )
+	{
+	perror( "pipe" );
+	exit( 1 );
+	}
+    pid = fork();
+    if ( pid < 0 )
+	{
+	perror( "fork" );
+	exit( 1 );
+	}
+    if ( pid == 0 )
+	{
+	(void) close( pipe_fds[0] );
+	(void) close( listen_fd );
+	(void) dup2( pipe_fds[1], 1 );
+	fd = open( "/dev/null", O_WRONLY );
+	if ( fd >= 0 )
+	    (void) dup2( fd, 2 );
+	(void) execv( http_load, args );
+	perror( http_load );
+	_exit( 1 );
+	}
+    (void) close( pipe_fds[1] );
+    serve( pipe_fds[0], out, sizeof(out) );
+    (void) close( pipe_fds[0] );
+    (void) waitpid( pid, &status, 0 );
+    (void) unlink( url_file );
+
+    (void) snprintf( line, sizeof(line), "  code 200 -- %d\n", FETCHES );
+    ok = WIFEXITED( status ) && WEXITSTATUS( status ) == 0 &&
+	sscanf( out, "%d fetches, %d max parallel, %lf bytes, in %lf seconds",
+	    &fetches, &max_parallel, &bytes, &seconds ) == 4 &&
+	fetches == FETCHES && bytes == (double) FETCHES * doc_len &&
+	seconds < 0.5 && ( ! all_200 || strstr( out, line ) != (char*) 0 ) &&
+	strstr( out, "timeouts" ) == (char*) 0;
+    (void) printf( "%-4s /%-9s", method, path );
+    for ( nargs = 7; args[nargs + 1] != (char*) 0; ++nargs )
+	(void) printf( " %s", args[nargs] );
+    (void) printf( "%s\n", ok ? "  ok" : "  FAILED" );
+    if ( ! ok )
+	(void) fputs( out, stdout );
+    return ok;
+    }
+
+
+int
+main( int argc, char** argv )
+    {
+    static char* modes[3][4] = {
+	{ (char*) 0 },
+	{ "-keepalive", (char*) 0 },
+	{ "-keepalive", "-pipeline", "4", (char*) 0 },
+	};
+    const char* http_load;
+    struct sockaddr_in sa;
+    socklen_t sa_len;
+    int m, ok;
+
+    http_load = argc > 1 ? argv[1] : "./http_load";
+    (void) signal( SIGPIPE, SIG_IGN );
+    /* If http_load hangs after all, don't hang with it. */
+    (void) alarm( 120 );
+
+    listen_fd = socket( AF_INET, SOCK_STREAM, 0 );
+    (void) memset( (void*) &sa, 0, sizeof(sa) );
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    sa.sin_port = 0;
+    sa_len = sizeof(sa);
+    if ( listen_fd < 0 ||
+	 bind( listen_fd, (struct sockaddr*) &sa, sizeof(sa) ) < 0 ||
+	 listen( listen_fd, 64 ) < 0 ||
+	 getsockname( listen_fd, (struct sockaddr*) &sa, &sa_len ) < 0 )
+	{
+	perror( "respcheck" );
+	exit( 1 );
+	}
+    port = ntohs( sa.sin_port );
+
+    ok = 1;
+    for ( m = 0; m < 3; ++m )
+	{
+	ok &= run( http_load, "head", "HEAD", 0, 1, modes[m] );
+	ok &= run( http_load, "continue", "GET", 5, 1, modes[m] );
+	ok &= run( http_load, "bigchunk", "GET", 0, 0, modes[m] );
+	}
+    exit( ok ? 0 : 1 );
+    }
@@ -0,0 +1,203 @@
+/* slotbench.c - time a scan over the connection slots
+**
+** Walks a table of connection slots the way pipeline_room() looks at
+** one, checking the state, pipeline count, request count and host of
+** each, for the old one-struct layout and for the hot/cold split that
+** http_load uses now.  Every slot is busy with a full pipeline, so each
+** scan goes all the way through, and the time per slot shows how much
+** memory each one drags in.  The structs are copied from http_load.c
+** by hand.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define CACHE_LINE 64
+
+#define CNST_CONNECTING 1
+#define CNST_PAUSING 4
+#define CNST_WRITING 6
+#define CNST_HANDSHAKE 7
+
+#define PIPELINE_DEPTH 4
+#define KEEPALIVE_MAX 100
+#define NUM_HOSTS 64
+#define NUM_URLS ( NUM_HOSTS * 4 )
+
+/* The connection struct before the split, 208 bytes. */
+typedef struct {
+    int url_num;
+    struct sockaddr_in sa;
+    int sa_len;
+    int conn_fd;
+    void* ssl;
+    int conn_state, header_state;
+    int did_connect, did_response;
+    int keep_alive, num_requests;
+    int prev_idle, next_idle;
+    int next_free;
+    void* pipe;
+    int pipe_first, pipe_count;
+    long long scheduled_at;
+    long long started_at;
+    long long connect_at;
+    long long request_at;
+    long long response_at;
+    long long done_at;
+    void* idle_timer;
+    void* wakeup_timer;
+    long content_length;
+    int chunked, chunk_state;
+    long chunk_left;
+    long bytes;
+    long checksum;
+    int http_status;
+    } fat_connection;
+
+/* And after: the part the scans and reads use, in one cache line. */
+typedef struct {
+    int url_num;
+    int conn_fd;
+    int num_requests;
+    int pipe_count;
+    int http_status;
+    int checksum;
+    unsigned char conn_state, header_state, chunk_state;
+    char did_response, keep_alive, chunked;
+    unsigned char unsent;
+    long content_length;
+    long chunk_left;
+    long bytes;
+    void* idle_timer;
+    } __attribute__((aligned(CACHE_LINE))) connection;
+
+static int url_host[NUM_URLS];
+
+
+static int
+busy( int state )
+    {
+    return ( state >= CNST_CONNECTING && state <= CNST_PAUSING ) ||
+	state == CNST_WRITING || state == CNST_HANDSHAKE;
+    }
+
+
+/* The same scan over each layout: the first slot with room for a request
+** to url_num, or -1.
+*/
+static int
+scan_fat( fat_connection* c, int n, int url_num )
+    {
+    int cnum;
+
+    for ( cnum = 0; cnum < n; ++cnum )
+	if ( busy( c[cnum].conn_state ) &&
+	     c[cnum].pipe_count < PIPELINE_DEPTH - 1 &&
+	     c[cnum].num_requests < KEEPALIVE_MAX &&
+	     url_host[c[cnum].url_num] == url_host[url_num] )
+	    return cnum;
+    return -1;
+    }
+
+
+static int
+scan_split( connection* c, int n, int url_num )
+    {
+    int cnum;
+
+    for ( cnum = 0; cnum < n; ++cnum )
+	if ( busy( c[cnum].conn_state ) &&
+	     c[cnum].pipe_count < PIPELINE_DEPTH - 1 &&
+	     c[cnum].num_requests < KEEPALIVE_MAX &&
+	     url_host[c[cnum].url_num] == url_host[url_num] )
+	    return cnum;
+    return -1;
+    }
+
+
+static long long
+nsecs( void )
+    {
+    struct timespec ts;
+
+    (void) clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+
+static void
+bench( int n )
+    {
+    fat_connection* fat;
+    connection* split;
+    int cnum, i, passes;
+    long found;
+    long long t, best_fat, best_split;
+
+    fat = (fat_connection*) malloc( n * sizeof(fat_connection) );
+    if ( fat == (fat_connection*) 0 ||
+	 posix_memalign( (void**) &split, CACHE_LINE, n * sizeof(connection) ) != 0 )
+	{
+	(void) fprintf( stderr, "out of memory\n" );
+	exit( 1 );
+	}
+    (void) memset( (void*) fat, 0, n * sizeof(fat_connection) );
+    (void) memset( (void*) split, 0, n * sizeof(connection) );
+    for ( cnum = 0; cnum < n; ++cnum )
+	{
+	fat[cnum].conn_state = split[cnum].conn_state =
+	    CNST_CONNECTING + cnum % 4;
+	fat[cnum].pipe_count = split[cnum].pipe_count = PIPELINE_DEPTH - 1;
+	fat[cnum].num_requests = split[cnum].num_requests = 1 + cnum % 50;
+	fat[cnum].url_num = split[cnum].url_num = cnum % NUM_URLS;
+	}
+
+    /* Best of a few runs of a hundred million slots or so each. */
+    passes = 100000000 / n;
+    best_fat = best_split = -1;
+    found = 0;
+    for ( i = 0; i < 5; ++i )
+	{
+	t = nsecs();
+	for ( cnum = 0; cnum < passes; ++cnum )
+	    found += scan_fat( fat, n, cnum % NUM_URLS );
+	t = nsecs() - t;
+	if ( best_fat < 0 || t < best_fat )
+	    best_fat = t;
+	t = nsecs();
+	for ( cnum = 0; cnum < passes; ++cnum )
+	    found += scan_split( split, n, cnum % NUM_URLS );
+	t = nsecs() - t;
+	if ( best_split < 0 || t < best_split )
+	    best_split = t;
+	}
+    /* No slot has room, so every scan comes back -1. */
+    if ( found != -2L * 5 * passes )
+	{
+	(void) fprintf( stderr, "a scan found room that isn't there\n" );
+	exit( 1 );
+	}
+    (void) printf( "%7d slots   %3d-byte slots %6.3f ns/slot   %3d-byte slots %6.3f ns/slot\n",
+	n, (int) sizeof(fat_connection), (double) best_fat / passes / n,
+	(int) sizeof(connection), (double) best_split / passes / n );
+    free( (void*) fat );
+    free( (void*) split );
+    }
+
+
+int
+main( int argc, char** argv )
+    {
+    int i;
+
+    for ( i = 0; i < NUM_URLS; ++i )
+	url_host[i] = i % NUM_HOSTS;
+    bench( 1000 );
+    bench( 10000 );
+    bench( 30000 );
+    bench( 100000 );
+    exit( 0 );
+    }
@@ -29,124 +29,310 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(USE_TSC) && ( defined(__x86_64__) || defined(__i386__) )
+#include <x86intrin.h>
+#include <cpuid.h>
+#define HAVE_TSC
+#endif
 
 #include "timers.h"
 
 
-#define HASH_SIZE 67
-static Timer* timers[HASH_SIZE];
-static Timer* free_timers = (Timer*) 0;
+/* Timers live on a hierarchy of timing wheels, in the style of Varghese
+** and Lauck.  The bottom wheel has a slot for each of the next WHEEL_SIZE
+** ticks, and each wheel above it has a slot per turn of the one below.
+** Adding or removing a timer is a list operation on one slot, and the
+** slots of the upper wheels get spilled down as their time comes.
+*/
+#define TICK_NSECS 1000000LL
+#define WHEEL_BITS 6
+#define WHEEL_SIZE ( 1 << WHEEL_BITS )
+#define WHEEL_MASK ( WHEEL_SIZE - 1 )
+#define WHEEL_LEVELS 4
+
+/* Timer.slot values for timers that aren't on a wheel. */
+#define SLOT_NONE -1
+#define SLOT_EXPIRING -2
+
+static __thread Timer* wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static __thread unsigned long long occupied[WHEEL_LEVELS];	/* bit per slot */
+static __thread long long wheel_tick;	/* the next tick to run */
+static __thread Timer* expiring;	/* timers from the slot being run */
+static __thread Timer* free_timers = (Timer*) 0;
 
 ClientData JunkClientData;
 
+#ifdef HAVE_TSC
+/* Set once by tmr_clock_init(), before there are other threads. */
+static int use_tsc = 0;
+static unsigned long long tsc_base;
+static long long ns_base;
+static unsigned long long tsc_mult;	/* nsecs per tick, times 2^32 */
+#endif /* HAVE_TSC */
+
+
+static long long
+mono_now( void )
+    {
+    struct timespec ts;
+
+    (void) clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+
+#ifdef HAVE_TSC
+/* Where the kernel says what it thinks of the counter, make sure it
+** thinks it runs at a constant rate and keeps going in deep sleep.
+** Without a /proc to ask, the CPUID bit has to do.
+*/
+static int
+tsc_flags_ok( void )
+    {
+    FILE* fp;
+    char line[10000];
+    int ok;
+
+    fp = fopen( "/proc/cpuinfo", "r" );
+    if ( fp == (FILE*) 0 )
+	return 1;
+    ok = 0;
+    while ( fgets( line, sizeof(line), fp ) != (char*) 0 )
+	if ( strncmp( line, "flags", 5 ) == 0 )
+	    {
+	    ok = strstr( line, " constant_tsc" ) != (char*) 0 &&
+		 strstr( line, " nonstop_tsc" ) != (char*) 0;
+	    break;
+	    }
+    (void) fclose( fp );
+    return ok;
+    }
+#endif /* HAVE_TSC */
 
 
-static unsigned int
-hash( Timer* t )
+void
+tmr_clock_init( void )
     {
-    /* We can hash on the trigger time, even though it can change over
-    ** the life of a timer via either the periodic bit or the tmr_reset()
-    ** call.  This is because both of those guys call l_resort(), which
-    ** recomputes the hash and moves the timer to the appropriate list.
+#ifdef HAVE_TSC
+    unsigned int eax, ebx, ecx, edx;
+    unsigned long long tsc0, tsc1;
+    long long ns0, ns1;
+    struct timespec ts;
+
+    /* Only an invariant counter ticks at the same rate on every CPU,
+    ** whatever the power state.
     */
-    return (
-	(unsigned int) t->time.tv_sec ^
-	(unsigned int) t->time.tv_usec ) % HASH_SIZE;
+    if ( ! __get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) ||
+	 ! ( edx & ( 1 << 8 ) ) || ! tsc_flags_ok() )
+	return;
+    ns0 = mono_now();
+    tsc0 = __rdtsc();
+    ts.tv_sec = 0;
+    ts.tv_nsec = 20000000L;
+    (void) nanosleep( &ts, (struct timespec*) 0 );
+    ns1 = mono_now();
+    tsc1 = __rdtsc();
+    if ( tsc1 <= tsc0 || ns1 <= ns0 )
+	return;
+    tsc_mult = ( (unsigned long long) ( ns1 - ns0 ) << 32 ) / ( tsc1 - tsc0 );
+    tsc_base = tsc1;
+    ns_base = ns1;
+    use_tsc = 1;
+#endif /* HAVE_TSC */
     }
 
 
-static void
-l_add( Timer* t )
+long long
+tmr_now( void )
     {
-    int h = t->hash;
-    register Timer* t2;
-    register Timer* t2prev;
+#ifdef HAVE_TSC
+    long long ticks;
 
-    t2 = timers[h];
-    if ( t2 == (Timer*) 0 )
-	{
-	/* The list is empty. */
-	timers[h] = t;
-	t->prev = t->next = (Timer*) 0;
-	}
-    else
+    if ( use_tsc )
 	{
-	if ( t->time.tv_sec < t2->time.tv_sec ||
-	     ( t->time.tv_sec == t2->time.tv_sec &&
-	       t->time.tv_usec <= t2->time.tv_usec ) )
-	    {
-	    /* The new timer goes at the head of the list. */
-	    timers[h] = t;
-	    t->prev = (Timer*) 0;
-	    t->next = t2;
-	    t2->prev = t;
-	    }
-	else
-	    {
-	    /* Walk the list to find the insertion point. */
-	    for ( t2prev = t2, t2 = t2->next; t2 != (Timer*) 0;
-		  t2prev = t2, t2 = t2->next )
-		{
-		if ( t->time.tv_sec < t2->time.tv_sec ||
-		     ( t->time.tv_sec == t2->time.tv_sec &&
-		       t->time.tv_usec <= t2->time.tv_usec ) )
-		    {
-		    /* Found it. */
-		    t2prev->next = t;
-		    t->prev = t2prev;
-		    t->next = t2;
-		    t2->prev = t;
-		    return;
-		    }
-		}
-	    /* Oops, got to the end of the list.  Add to tail. */
-	    t2prev->next = t;
-	    t->prev = t2prev;
-	    t->next = (Timer*) 0;
-	    }
+	/* A CPU whose counter is a little behind the one that calibrated
+	** it can read below tsc_base just after startup.  Unsigned, that
+	** would be centuries from now.
+	*/
+	ticks = (long long) ( __rdtsc() - tsc_base );
+	if ( ticks < 0 )
+	    ticks = 0;
+	return ns_base + (long long) (
+	    ( (unsigned __int128) ticks * tsc_mult ) >> 32 );
 	}
+#endif /* HAVE_TSC */
+    return mono_now();
+    }
+
+
+
+/* A timer is filed under the tick it is due in, rounded up, so it never
+** runs early.
+*/
+static long long
+due_tick( Timer* t )
+    {
+    return ( t->time + TICK_NSECS - 1 ) / TICK_NSECS;
+    }
+
+
+static void
+l_add( Timer* t )
+    {
+    long long due = due_tick( t );
+    long long delta = due - wheel_tick;
+    int level, s;
+
+    /* Work out which wheel covers the wait, and the slot in it that gets
+    ** emptied no later than the due tick.  Anything further off than the
+    ** top wheel reaches parks in its last slot and gets filed again from
+    ** there.
+    */
+    if ( delta < 0 )
+	due = wheel_tick;
+    for ( level = 0; level < WHEEL_LEVELS - 1; ++level )
+	if ( delta < 1LL << ( WHEEL_BITS * ( level + 1 ) ) )
+	    break;
+    if ( delta >= 1LL << ( WHEEL_BITS * WHEEL_LEVELS ) )
+	due = wheel_tick + ( 1LL << ( WHEEL_BITS * WHEEL_LEVELS ) ) - 1;
+    s = (int) ( due >> ( WHEEL_BITS * level ) ) & WHEEL_MASK;
+    t->slot = level * WHEEL_SIZE + s;
+
+    t->prev = (Timer*) 0;
+    t->next = wheel[level][s];
+    if ( t->next != (Timer*) 0 )
+	t->next->prev = t;
+    wheel[level][s] = t;
+    occupied[level] |= 1ULL << s;
     }
 
 
 static void
 l_remove( Timer* t )
     {
-    int h = t->hash;
+    int level, s;
 
-    if ( t->prev == (Timer*) 0 )
-	timers[h] = t->next;
-    else
+    if ( t->slot == SLOT_NONE )
+	return;
+    if ( t->prev != (Timer*) 0 )
 	t->prev->next = t->next;
+    else if ( t->slot == SLOT_EXPIRING )
+	expiring = t->next;
+    else
+	{
+	level = t->slot / WHEEL_SIZE;
+	s = t->slot % WHEEL_SIZE;
+	wheel[level][s] = t->next;
+	if ( t->next == (Timer*) 0 )
+	    occupied[level] &= ~( 1ULL << s );
+	}
     if ( t->next != (Timer*) 0 )
 	t->next->prev = t->prev;
+    t->slot = SLOT_NONE;
+    }
+
+
+/* Take every timer out of a slot, and return them as a list. */
+static Timer*
+l_take( int level, int s )
+    {
+    Timer* t;
+
+    t = wheel[level][s];
+    wheel[level][s] = (Timer*) 0;
+    occupied[level] &= ~( 1ULL << s );
+    return t;
     }
 
 
+/* Returns the first tick at or after wheel_tick that has anything to do,
+** or -1 if there are no timers.  For the upper wheels that's when a slot
+** gets emptied into the lower ones, which is no later than its timers
+** are due.
+*/
+static long long
+next_tick( void )
+    {
+    int level, shift, q, d;
+    long long c, tick, best;
+    unsigned long long bits;
+
+    best = -1;
+    for ( level = 0; level < WHEEL_LEVELS; ++level )
+	{
+	if ( occupied[level] == 0 )
+	    continue;
+	shift = WHEEL_BITS * level;
+	/* The next tick this wheel turns on, and the slot it empties then. */
+	c = ( ( wheel_tick + ( 1LL << shift ) - 1 ) >> shift ) << shift;
+	q = (int) ( c >> shift ) & WHEEL_MASK;
+	bits = occupied[level];
+	bits = ( bits >> q ) | ( bits << ( ( WHEEL_SIZE - q ) & WHEEL_MASK ) );
+	d = __builtin_ctzll( bits );
+	tick = c + ( (long long) d << shift );
+	if ( best == -1 || tick < best )
+	    best = tick;
+	}
+    return best;
+    }
+
+
+/* Do the work for wheel_tick: spill whichever upper-wheel slots come due
+** into the lower wheels, and move the timers in this tick's slot onto
+** the expiring list.  Then step on to the next tick.
+*/
 static void
-l_resort( Timer* t )
+turn_wheel( void )
     {
-    /* Remove the timer from its old list. */
-    l_remove( t );
-    /* Recompute the hash. */
-    t->hash = hash( t );
-    /* And add it back in to its new list, sorted correctly. */
-    l_add( t );
+    int level, shift;
+    Timer* t;
+    Timer* next;
+
+    for ( level = 1; level < WHEEL_LEVELS; ++level )
+	{
+	shift = WHEEL_BITS * level;
+	if ( wheel_tick & ( ( 1LL << shift ) - 1 ) )
+	    break;
+	for ( t = l_take( level, (int) ( wheel_tick >> shift ) & WHEEL_MASK );
+	      t != (Timer*) 0; t = next )
+	    {
+	    next = t->next;
+	    l_add( t );
+	    }
+	}
+
+    expiring = l_take( 0, (int) wheel_tick & WHEEL_MASK );
+    for ( t = expiring; t != (Timer*) 0; t = t->next )
+	t->slot = SLOT_EXPIRING;
+    /* Step on first, so timers set up by the callbacks for right now
+    ** land in the next slot rather than one a whole turn away.
+    */
+    ++wheel_tick;
     }
 
 
 void
 tmr_init( void )
     {
-    int h;
+    int level, s;
 
-    for ( h = 0; h < HASH_SIZE; ++h )
-	timers[h] = (Timer*) 0;
+    for ( level = 0; level < WHEEL_LEVELS; ++level )
+	{
+	for ( s = 0; s < WHEEL_SIZE; ++s )
+	    wheel[level][s] = (Timer*) 0;
+	occupied[level] = 0;
+	}
+    expiring = (Timer*) 0;
+    wheel_tick = tmr_now() / TICK_NSECS;
     }
 
 
 Timer*
 tmr_create(
-    struct timeval* nowP, TimerProc* timer_proc, ClientData client_data,
+    long long* nowP, TimerProc* timer_proc, ClientData client_data,
     long msecs, int periodic )
     {
     Timer* t;
@@ -167,19 +353,12 @@ tmr_create(
     t->client_data = client_data;
     t->msecs = msecs;
     t->periodic = periodic;
-    if ( nowP != (struct timeval*) 0 )
+    if ( nowP != (long long*) 0 )
 	t->time = *nowP;
     else
-	(void) gettimeofday( &t->time, (struct timezone*) 0 );
-    t->time.tv_sec += msecs / 1000L;
-    t->time.tv_usec += ( msecs % 1000L ) * 1000L;
-    if ( t->time.tv_usec >= 1000000L )
-	{
-	t->time.tv_sec += t->time.tv_usec / 1000000L;
-	t->time.tv_usec %= 1000000L;
-	}
-    t->hash = hash( t );
-    /* Add the new timer to the proper active list. */
+	t->time = tmr_now();
+    t->time += msecs * 1000000LL;
+    /* Add the new timer to the proper wheel. */
     l_add( t );
 
     return t;
@@ -187,7 +366,7 @@ tmr_create(
 
 
 struct timeval*
-tmr_timeout( struct timeval* nowP )
+tmr_timeout( long long* nowP )
     {
     long msecs;
     static struct timeval timeout;
@@ -202,36 +381,16 @@ tmr_timeout( struct timeval* nowP )
 
 
 long
-tmr_mstimeout( struct timeval* nowP )
+tmr_mstimeout( long long* nowP )
     {
-    int h;
-    int gotone;
-    long msecs, m;
-    register Timer* t;
-
-    gotone = 0;
-    msecs = 0;          /* make lint happy */
-    /* Since the lists are sorted, we only need to look at the
-    ** first timer on each one.
-    */
-    for ( h = 0; h < HASH_SIZE; ++h )
-	{
-	t = timers[h];
-	if ( t != (Timer*) 0 )
-	    {
-	    m = ( t->time.tv_sec - nowP->tv_sec ) * 1000L +
-		( t->time.tv_usec - nowP->tv_usec ) / 1000L;
-	    if ( ! gotone )
-		{
-		msecs = m;
-		gotone = 1;
-		}
-	    else if ( m < msecs )
-		msecs = m;
-	    }
-	}
-    if ( ! gotone )
+    long long tick;
+    long msecs;
+
+    tick = next_tick();
+    if ( tick == -1 )
 	return INFTIM;
+    /* Round up, so we don't wake up just short of it and spin. */
+    msecs = (long) ( ( tick * TICK_NSECS - *nowP + 999999LL ) / 1000000LL );
     if ( msecs <= 0 )
 	msecs = 0;
     return msecs;
@@ -239,66 +398,75 @@ tmr_mstimeout( struct timeval* nowP )
 
 
 void
-tmr_run( struct timeval* nowP )
+tmr_run( long long* nowP )
     {
-    int h;
+    long long now_tick, tick;
     Timer* t;
-    Timer* next;
 
-    for ( h = 0; h < HASH_SIZE; ++h )
-	for ( t = timers[h]; t != (Timer*) 0; t = next )
+    now_tick = *nowP / TICK_NSECS;
+    while ( wheel_tick <= now_tick )
+	{
+	/* Skip straight over the ticks with nothing to do. */
+	tick = next_tick();
+	if ( tick == -1 || tick > now_tick )
 	    {
-	    next = t->next;
-	    /* Since the lists are sorted, as soon as we find a timer
-	    ** that isn't ready yet, we can go on to the next list.
-	    */
-	    if ( t->time.tv_sec > nowP->tv_sec ||
-		 ( t->time.tv_sec == nowP->tv_sec &&
-		   t->time.tv_usec > nowP->tv_usec ) )
-		break;
+	    wheel_tick = now_tick + 1;
+	    break;
+	    }
+	wheel_tick = tick;
+	turn_wheel();
+
+	while ( ( t = expiring ) != (Timer*) 0 )
+	    {
+	    l_remove( t );
+	    /* Pushed back by a tmr_reset() since it was filed. */
+	    if ( due_tick( t ) >= wheel_tick )
+		{
+		l_add( t );
+		continue;
+		}
 	    (t->timer_proc)( t->client_data, nowP );
 	    if ( t->periodic )
 		{
 		/* Reschedule. */
-		t->time.tv_sec += t->msecs / 1000L;
-		t->time.tv_usec += ( t->msecs % 1000L ) * 1000L;
-		if ( t->time.tv_usec >= 1000000L )
-		    {
-		    t->time.tv_sec += t->time.tv_usec / 1000000L;
-		    t->time.tv_usec %= 1000000L;
-		    }
-		l_resort( t );
+		t->time += t->msecs * 1000000LL;
+		l_add( t );
 		}
 	    else
 		tmr_cancel( t );
 	    }
+	}
     }
 
 
 void
-tmr_reset( struct timeval* nowP, Timer* t )
+tmr_reset( long long* nowP, Timer* t )
     {
-    t->time = *nowP;
-    t->time.tv_sec += t->msecs / 1000L;
-    t->time.tv_usec += ( t->msecs % 1000L ) * 1000L;
-    if ( t->time.tv_usec >= 1000000L )
+    long long time = *nowP + t->msecs * 1000000LL;
+
+    /* Idle timers get pushed back on every read.  A timer that only
+    ** moves later can stay where it is; when its slot comes round it
+    ** just gets filed again.
+    */
+    if ( time >= t->time )
 	{
-	t->time.tv_sec += t->time.tv_usec / 1000000L;
-	t->time.tv_usec %= 1000000L;
+	t->time = time;
+	return;
 	}
-    l_resort( t );
+    l_remove( t );
+    t->time = time;
+    l_add( t );
     }
 
 
 void
 tmr_cancel( Timer* t )
     {
-    /* Remove it from its active list. */
+    /* Remove it from its wheel. */
     l_remove( t );
     /* And put it on the free list. */
     t->next = free_timers;
     free_timers = t;
-    t->prev = (Timer*) 0;
     }
 
 
@@ -319,10 +487,13 @@ tmr_cleanup( void )
 void
 tmr_destroy( void )
     {
-    int h;
-
-    for ( h = 0; h < HASH_SIZE; ++h )
-	while ( timers[h] != (Timer*) 0 )
-	    tmr_cancel( timers[h] );
+    int level, s;
+
+    while ( expiring != (Timer*) 0 )
+	tmr_cancel( expiring );
+    for ( level = 0; level < WHEEL_LEVELS; ++level )
+	for ( s = 0; s < WHEEL_SIZE; ++s )
+	    while ( wheel[level][s] != (Timer*) 0 )
+		tmr_cancel( wheel[level][s] );
     tmr_cleanup();
     }
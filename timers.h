@@ -46,11 +46,15 @@ typedef union {
 
 extern ClientData JunkClientData;	/* for use when you don't care */
 
+/* All times are nanoseconds on the monotonic clock, as returned by
+** tmr_now().  Only differences between them mean anything.
+*/
+
 /* The TimerProc gets called when the timer expires.  It gets passed
-** the ClientData associated with the timer, and a timeval in case
+** the ClientData associated with the timer, and the current time in case
 ** it wants to schedule another timer.
 */
-typedef void TimerProc( ClientData client_data, struct timeval* nowP );
+typedef void TimerProc( ClientData client_data, long long* nowP );
 
 /* The Timer struct. */
 typedef struct TimerStruct {
@@ -58,39 +62,55 @@ typedef struct TimerStruct {
     ClientData client_data;
     long msecs;
     int periodic;
-    struct timeval time;
+    long long time;
     struct TimerStruct* prev;
     struct TimerStruct* next;
-    int hash;
+    int slot;
     } Timer;
 
-/* Initialize the timer package. */
+/* Set up the clock, once per program, before any threads are started.
+** Only does anything when built with USE_TSC, where it calibrates the
+** CPU's time stamp counter against the monotonic clock.  Unless the
+** CPU and the kernel both say the counter is constant-rate and nonstop,
+** the monotonic clock is used anyway.
+*/
+extern void tmr_clock_init( void );
+
+/* Returns the current time. */
+extern long long tmr_now( void );
+
+/* Initialize the timer package.  Timers are kept per thread: a timer must
+** be created, reset, cancelled and run by the same thread, and each thread
+** calls tmr_init() before using them.
+*/
 extern void tmr_init( void );
 
 /* Set up a timer, either periodic or one-shot. Returns (Timer*) 0 on errors. */
 extern Timer* tmr_create(
-    struct timeval* nowP, TimerProc* timer_proc, ClientData client_data,
+    long long* nowP, TimerProc* timer_proc, ClientData client_data,
     long msecs, int periodic );
 
 /* Returns a timeout indicating how long until the next timer triggers.  You
 ** can just put the call to this routine right in your select().  Returns
 ** (struct timeval*) 0 if no timers are pending.
 */
-extern struct timeval* tmr_timeout( struct timeval* nowP );
+extern struct timeval* tmr_timeout( long long* nowP );
 
 /* Returns a timeout in milliseconds indicating how long until the next timer
 ** triggers.  You can just put the call to this routine right in your poll().
 ** Returns INFTIM (-1) if no timers are pending.
 */
-extern long tmr_mstimeout( struct timeval* nowP );
+extern long tmr_mstimeout( long long* nowP );
 
 /* Run the list of timers. Your main program needs to call this every so often,
 ** or as indicated by tmr_timeout().
 */
-extern void tmr_run( struct timeval* nowP );
+extern void tmr_run( long long* nowP );
 
-/* Reset the clock on a timer, to current time plus the original timeout. */
-extern void tmr_reset( struct timeval* nowP, Timer* timer );
+/* Reset the clock on a timer, to current time plus the original timeout.
+** Pushing a timer later is cheap enough to do on every read.
+*/
+extern void tmr_reset( long long* nowP, Timer* timer );
 
 /* Deschedule a timer.  Note that non-periodic timers are automatically
 ** descheduled when they run, so you don't have to call this on them.